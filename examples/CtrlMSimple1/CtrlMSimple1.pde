@@ -58,8 +58,10 @@ void loop()
     Serial.println( n, HEX);
 #if 1
     CtrlM_setRGB( ctrlm_addr, n, n, n );
-    delay( dtime );
+    CtrlM_waitForIR( ctrlm_addr );  // wait for it to get there, then
+    delay( dtime );                 // leave it on dtime
     CtrlM_setRGB( ctrlm_addr, 0,0,0 );
+    CtrlM_waitForIR( ctrlm_addr );
     //n++;
 #endif
 
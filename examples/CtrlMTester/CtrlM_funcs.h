@@ -190,6 +190,128 @@ static void CtrlM_setSendAddress( byte addr, byte freem_addr, byte blinkm_addr)
   Wire.endTransmission();  
 }
 
+// Make the CtrlM at addr answer count (1-8) i2c addresses, addr & up, 
+// saved in its EEPROM.  Just addr by default, so make sure nothing else
+// is on the ones after it.
+static void CtrlM_setAddressCount( byte addr, byte count )
+{
+  //{'M', 0, count, 0 } -- answer count i2c addrs
+  Wire.beginTransmission(addr);
+  Wire.send('M');
+  Wire.send( 0 );
+  Wire.send( count );
+  Wire.send( 0 );
+  Wire.endTransmission();
+  delay(50); // just in case
+}
+
+// With CtrlM_setAddressCount(), the CtrlM at addr also answers addr+1 ..
+// Commands sent to addr+vaddr go to freem_addr & blinkm_addr, saved in 
+// the CtrlM's EEPROM, with no CtrlM_setSendAddress() needed.  By default
+// addr+n goes to FreeM n.
+static void CtrlM_setVirtualAddress( byte addr, byte vaddr,
+                                     byte freem_addr, byte blinkm_addr)
+{
+  //{'M', vaddr, freem_addr, blinkm_addr } -- set where i2c addr+vaddr goes
+  Wire.beginTransmission(addr);
+  Wire.send('M');
+  Wire.send( vaddr );
+  Wire.send( freem_addr );
+  Wire.send( blinkm_addr );
+  Wire.endTransmission();
+}
+
+// freem_addr to use with CtrlM_setSendAddress() to reach FreeM group g (0-15)
+#define CTRLM_GROUP(g)  (0xf0|(g))
+
+// Put the FreeM set with CtrlM_setSendAddress() in the groups whose bits 
+// are set in 'groups' (bit g = group g), replacing the groups it was in
+static void CtrlM_setFreeMGroups( byte addr, uint16_t groups)
+{
+  //{'+', groups_msb, groups_lsb, 0 }  -- put FreeM freem_addr in groups
+  Wire.beginTransmission(addr);
+  Wire.send('+');
+  Wire.send( (byte)(groups >> 8) );
+  Wire.send( (byte)(groups & 0xff) );
+  Wire.send(0);
+  Wire.endTransmission();  
+}
+
+// Set colorspot 'pos' of FreeMs 'base_addr' to 'base_addr'+n-1, the
+// i-th color r,g,b in rgb[3*i..3*i+2].  Sent in chunks to fit the Wire 
+// buffer.  Use CTRLM_FRAME_IMAGE so they go out as a few image frames.
+static void CtrlM_setImage(byte addr, byte pos, byte base_addr, 
+                           byte* rgb, int n)
+{
+  //{'=', pos, base_addr, n, n x {r,g,b} }  -- set colorspot pos of n FreeMs
+  while( n > 0 ) {
+    byte cnt = (n > 9) ? 9 : n;   // 4 + 9*3 bytes <= Wire's 32
+    Wire.beginTransmission(addr);
+    Wire.send('=');
+    Wire.send( pos );
+    Wire.send( base_addr );
+    Wire.send( cnt );
+    Wire.send( rgb, cnt*3 );
+    Wire.endTransmission();
+    base_addr += cnt;
+    rgb += cnt*3;
+    n -= cnt;
+  }
+}
+
+// '{' bulk write types
+#define CTRLM_BULK_COLORSPOTS 0
+#define CTRLM_BULK_SCRIPT     1
+
+// Write n lines to the CtrlM's EEPROM script, starting at line 'pos',
+// each {dur, cmd, arg1, arg2, arg3} in lines[5*i..5*i+4].  The script
+// then ends after them.  Sent in chunks to fit the Wire buffer.
+static void CtrlM_writeScript(byte addr, byte pos, byte* lines, int n)
+{
+  //{'{', type, id, base, n, n x item }  -- bulk write n items
+  while( n > 0 ) {
+    byte cnt = (n > 5) ? 5 : n;   // 5 + 5*5 bytes <= Wire's 32
+    Wire.beginTransmission(addr);
+    Wire.send('{');
+    Wire.send( CTRLM_BULK_SCRIPT );
+    Wire.send( 0 );               // script id, 0 = EEPROM
+    Wire.send( pos );
+    Wire.send( cnt );
+    Wire.send( lines, cnt*5 );
+    Wire.endTransmission();
+    pos += cnt;
+    lines += cnt*5;
+    n -= cnt;
+  }
+}
+
+// Set palette color 'idx' (0-15), in the CtrlM and the FreeMs set with
+// CtrlM_setSendAddress(), for CTRLM_IMG_PAL
+static void CtrlM_setPaletteColor(byte addr, byte idx, byte r, byte g, byte b)
+{
+  //{':', idx, r,g,b }  -- set palette color idx
+  Wire.beginTransmission(addr);
+  Wire.send(':');
+  Wire.send( idx );
+  Wire.send( r );
+  Wire.send( g );
+  Wire.send( b );
+  Wire.endTransmission();  
+}
+
+// Copy colorspot 'src_pos' to 'dst_pos' on the FreeMs set with 
+// CtrlM_setSendAddress(), to start a new image from an old one
+static void CtrlM_copyColorSpot(byte addr, byte src_pos, byte dst_pos)
+{
+  //{'>', src_pos, dst_pos, 0 }  -- copy colorspot src_pos to dst_pos
+  Wire.beginTransmission(addr);
+  Wire.send('>');
+  Wire.send( src_pos );
+  Wire.send( dst_pos );
+  Wire.send(0);
+  Wire.endTransmission();  
+}
+
 //
 static void CtrlM_writeFreeMAddress(byte addr, byte freem_addr )
 {
@@ -219,6 +341,164 @@ static void CtrlM_setIRFreq(byte addr, uint16_t irfreq, byte duty_percent)
   Wire.endTransmission();  
 }
 
+// Options for CtrlM_setOption()
+#define CTRLM_OPT_IR_MODE   0   // IR frame timing, see below
+#define CTRLM_OPT_FRAME_FLAGS 1 // which IR frame formats to use, see below
+#define CTRLM_OPT_REPEATS   2   // times to send each IR frame, default 1
+#define CTRLM_OPT_STREAM    3   // 1 = send back-to-back frames as one stream
+#define CTRLM_OPT_IMAGE_ENC 4   // colors of CtrlM_setImage(), see below
+#define CTRLM_OPT_SAVE      5   // remember FRAME_FLAGS & IMAGE_ENC, value unused
+#define CTRLM_OPT_RESTORE   6   // go back to what CTRLM_OPT_SAVE remembered
+
+// Values for CTRLM_OPT_IR_MODE
+#define CTRLM_IR_MODE_SONY  0   // standard Sony timing, the default
+#define CTRLM_IR_MODE_FAST  1   // shorter "fast data" timing, ~2x faster
+#define CTRLM_IR_MODE_PPM   2   // 2 bits per space pulse-position, ~3x faster
+
+// Bits for CTRLM_OPT_FRAME_FLAGS
+#define CTRLM_FRAME_SHORT   0x01 // send 0-2 arg cmds in shorter frames
+#define CTRLM_FRAME_AGGREGATE 0x02 // send queued cmds together in one frame
+#define CTRLM_FRAME_FEC     0x04 // add CRC-8 & parity, receivers fix 1-bit errors
+#define CTRLM_FRAME_SEQ     0x08 // add sequence number, receivers drop repeats
+#define CTRLM_FRAME_CONTEXT 0x10 // send addresses once, then cmds without them
+#define CTRLM_FRAME_IMAGE   0x20 // send colorspots of FreeM runs in one frame
+
+// values for CTRLM_OPT_IMAGE_ENC, with CTRLM_FRAME_IMAGE
+#define CTRLM_IMG_RGB       0   // 3 bytes a color, the default
+#define CTRLM_IMG_565       1   // RGB565, 2 bytes a color
+#define CTRLM_IMG_PAL       2   // nearest palette color, 4 bits a color
+
+// Sets a CtrlM option, like which IR timing mode to send with
+static void CtrlM_setOption(byte addr, byte option, byte value)
+{
+  Wire.beginTransmission(addr);
+  Wire.send('~');
+  Wire.send( option );
+  Wire.send( value );
+  Wire.send( 0 );
+  Wire.endTransmission();  
+}
+
+// Sets just the given bits of an option, like CTRLM_FRAME_IMAGE in
+// CTRLM_OPT_FRAME_FLAGS, leaving the others as they are
+static void CtrlM_setOptionBits(byte addr, byte option, byte bits)
+{
+  Wire.beginTransmission(addr);
+  Wire.send('~');
+  Wire.send( option );
+  Wire.send( bits );
+  Wire.send( 1 );
+  Wire.endTransmission();  
+}
+
+// Fields for CtrlM_setTiming() & CtrlM_getTiming(), all in tens of usec
+#define CTRLM_TM_HDR_MARK   0
+#define CTRLM_TM_HDR_SPACE  1
+#define CTRLM_TM_ONE_MARK   2
+#define CTRLM_TM_ZERO_MARK  3
+#define CTRLM_TM_SPACE      4
+#define CTRLM_TM_SPACE_STEP 5   // CTRLM_IR_MODE_PPM only
+#define CTRLM_TM_GAP        6   // time between frames
+#define CTRLM_TM_BURST      7   // frames sent before a RECOVER gap, 0 = no limit
+#define CTRLM_TM_RECOVER    8   // time after each BURST frames, for the receivers
+#define CTRLM_TM_SYNC       9   // mark between frames with CTRLM_OPT_STREAM
+
+// Special fields for CtrlM_setTiming()
+#define CTRLM_TM_SAVE       0x40 // save IR mode & timing for next boot
+#define CTRLM_TM_DEFAULTS   0x41 // back to built-in timing for IR mode
+
+// Sets one IR frame timing field, t in tens of usec, 0 only for
+// CTRLM_TM_BURST, CTRLM_TM_RECOVER & CTRLM_TM_SYNC, where it means off
+// (setting the IR mode with CtrlM_setOption() resets these)
+static void CtrlM_setTiming(byte addr, byte field, uint16_t t)
+{
+  Wire.beginTransmission(addr);
+  Wire.send('&');
+  Wire.send( field );
+  Wire.send( (byte)(t >> 8) );   // msb
+  Wire.send( (byte)(t & 0xff) ); // lsb
+  Wire.endTransmission();  
+}
+
+// Throws away any reply the CtrlM has that wasn't read, before asking
+// for a new one
+static void CtrlM_flushReply(byte addr)
+{
+  Wire.requestFrom(addr, (byte)8);
+  while( Wire.available() ) 
+    Wire.receive();
+}
+
+// Reads a len-byte reply, to be read with Wire.receive().  The CtrlM 
+// NACKs until it has the reply, which can take a while when it's 
+// waiting for room to queue IR frames, so keeps asking for up to 2 secs.
+// Returns 0, or -1 if the CtrlM didn't answer.
+static int CtrlM_waitForReply(byte addr, byte len)
+{
+  for( int i=0; i<200; i++ ) {
+    Wire.requestFrom(addr, len);
+    if( Wire.available() >= len ) 
+      return 0;
+    while( Wire.available() ) 
+      Wire.receive();
+    delay(10);
+  }
+  return -1;
+}
+
+// Gets one IR frame timing field, in tens of usec, or -1 on error
+static long CtrlM_getTiming(byte addr, byte field)
+{
+  CtrlM_flushReply( addr );
+  Wire.beginTransmission(addr);
+  Wire.send('&');
+  Wire.send( field | 0x80 );
+  Wire.send( 0 );
+  Wire.send( 0 );
+  Wire.endTransmission();  
+  if( CtrlM_waitForReply( addr, 2 ) != 0 ) 
+    return -1;
+  uint16_t t = Wire.receive() << 8;
+  t |= Wire.receive();
+  return t;
+}
+
+// Get how long, in usec, until everything the CtrlM has queued is on 
+// the air ('backlog'), and how long the last command sent takes ('last').
+// If dropped isn't 0, it gets how many replies the CtrlM dropped since 
+// the last time, because the one before was still unread.
+// Returns 0, or -1 if the CtrlM didn't answer.
+static int CtrlM_getAirtime(byte addr, uint32_t* backlog, uint32_t* last,
+                            byte* dropped)
+{
+  CtrlM_flushReply( addr );
+  Wire.beginTransmission(addr);
+  Wire.send('?');
+  Wire.endTransmission();  
+  if( CtrlM_waitForReply( addr, 7 ) != 0 ) 
+    return -1;
+  *backlog  = (uint32_t)Wire.receive() << 16;
+  *backlog |= (uint32_t)Wire.receive() << 8;
+  *backlog |= Wire.receive();
+  *last  = (uint32_t)Wire.receive() << 16;
+  *last |= (uint32_t)Wire.receive() << 8;
+  *last |= Wire.receive();
+  byte d = Wire.receive();
+  if( dropped ) 
+    *dropped = d;
+  return 0;
+}
+
+// Wait until everything sent to the CtrlM so far is on the air
+static void CtrlM_waitForIR(byte addr)
+{
+  uint32_t backlog, last;
+  if( CtrlM_getAirtime( addr, &backlog, &last, 0 ) != 0 ) 
+    return;
+  delay( backlog / 1000 );
+  delayMicroseconds( backlog % 1000 );
+}
+
 static void CtrlM_turnIRLED(byte addr, byte on)
 {
   Wire.beginTransmission(addr);
@@ -229,6 +509,13 @@ static void CtrlM_turnIRLED(byte addr, byte on)
   Wire.endTransmission();  
 }
 
+// Values for codetype in CtrlM_sendIRCode()
+#define CTRLM_IRCODE_SONY  0   // 12-bit Sony
+#define CTRLM_IRCODE_RC5   1   // 12-bit RC5 (toggle, address, command)
+#define CTRLM_IRCODE_NEC   2   // 32-bit NEC
+#define CTRLM_IRCODE_RC6   3   // 20-bit RC6 (mode, toggle, addr, cmd)
+
+// Sends a regular IR remote code, the low bits of code
 static void CtrlM_sendIRCode( byte addr, uint8_t codetype, uint32_t code )
 {
   Wire.beginTransmission(addr);
@@ -22,9 +22,9 @@
  * 3. 
  *
  * B. Loading the image onto FreeMs
- * 1. March through each pixel of 10x10 grid
- * 2. Set LinkM to apppropriate FreeM address
- * 3. Send SetColorSpot command to FreeM(s)
+ * 1. March through the pixels of 10x10 grid, a few at a time
+ * 2. Send them with the CtrlM '=' command, FreeM address = pixel# + 1
+ * 3. CtrlM sends them to FreeMs as image frames
  *
  * C. Display image already on FreeMs
  * 1. Broadcast "change to color location #12" 
@@ -56,6 +56,8 @@ int strideb = 10; // border between pixels
 
 int dispMode = 0;
 boolean uploading = false;
+int imgChunk = 4;  // colors per '=' write, to fit in one LinkM i2c write
+int[][] sentpx = new int[btncnt][]; // pixels on FreeMs' colorspots, or null
 
 String setname = "gridset.txt";
 String imgpath = "jelly.jpg";
@@ -474,6 +476,10 @@ public void displayColors(boolean shouldSend) {
 }
 
 // Upload a display of colors 
+// The whole image goes to the CtrlM as a few '=' writes, which it sends
+// as image frames, several FreeMs' colors each, so no per-pixel delays.
+// Only pixels that changed are sent: the FreeMs start from whichever 
+// colorspot we've sent that's most like the new image, copied with '>'.
 public void uploadColors() {
   status("Uploading image "+imgn+"...");
   
@@ -486,23 +492,50 @@ public void uploadColors() {
     uploading = true;
     int n = imgn; // save in case user changes displayed image
     int[] px = imgb[n].pixels;
-    for( int i=0; i< px.length; i++ ){
-      status("sending pixel "+i);
-      int pixel = px[i];
-      int r = int(red(pixel));
-      int g = int(green(pixel));
-      int b = int(blue(pixel));
-      
-      int freem_addr = i + 1; // can't use zero == broadcast
-
-      linkm.ctrlmSetSendAddress( ctrlmaddr, freem_addr, 0);  // quick, in ctrlm
-      linkm.ctrlmSetFreeMColorSpot( ctrlmaddr, n,  r,g,b );
-      //linkm.ctrlmSetFreeMColorSpot( ctrlmaddr, i,  r,g,b ); // wrong,but debug
-      delay( 100 );
+    int from = n;
+    int best = diffCount( sentpx[n], px );
+    for( int b=0; b< btncnt; b++ ) {
+      int d = diffCount( sentpx[b], px ) + 1; // +1 for the copy
+      if( d < best ) { best = d; from = b; }
+    }
+    int[] old = sentpx[from];
+    sentpx[n] = null;  // don't know what's there until we're done
+    ctrlmCommand( new byte[] { '~', 5, 0, 0 } );    // save frame flags & enc
+    ctrlmCommand( new byte[] { '~', 1, 0x20, 1 } ); // FRAME_IMAGE on too
+    ctrlmCommand( new byte[] { '~', 4, 1, 0 } );    // as RGB565, 8 a frame
+    if( from != n ) { 
+      status("starting from image "+from);
+      linkm.ctrlmSetSendAddress( ctrlmaddr, 0,0 );  // all FreeMs
+      ctrlmCommand( new byte[] { '>', (byte)from, (byte)n, 0 } );
+    }
+    int i = 0;
+    while( i < px.length ) {
+      if( old != null && old[i] == px[i] ) { i++; continue; }
+      int cnt = 0;  // run of changed pixels
+      while( cnt < imgChunk && i+cnt < px.length && 
+             (old == null || old[i+cnt] != px[i+cnt]) ) { 
+        cnt++;
+      }
+      status("sending pixels "+i+"-"+(i+cnt-1));
+      byte[] cmd = new byte[ 4 + 3*cnt ];
+      cmd[0] = '=';
+      cmd[1] = (byte)n;
+      cmd[2] = (byte)(i + 1);  // can't use zero == broadcast
+      cmd[3] = (byte)cnt;
+      for( int j=0; j< cnt; j++ ) { 
+        int pixel = px[i+j];
+        cmd[4+3*j+0] = (byte)int(red(pixel));
+        cmd[4+3*j+1] = (byte)int(green(pixel));
+        cmd[4+3*j+2] = (byte)int(blue(pixel));
+      }
+      ctrlmCommand( cmd );
+      i += cnt;
       if( uploading == false ) { break; }
     }
-
-    linkm.ctrlmSetSendAddress( ctrlmaddr, 0,0 ); // talk to everyone again
+    ctrlmCommand( new byte[] { '~', 6, 0, 0 } );    // back to saved ones
+    if( uploading ) { 
+      sentpx[n] = px.clone();
+    }
     
   } catch( IOException ioe ) {
     status("io error:"+ioe.getMessage());
@@ -512,6 +545,21 @@ public void uploadColors() {
 
 }	
 
+// how many pixels of px differ from sent, all of them if unknown
+int diffCount( int[] sent, int[] px ) {
+  if( sent == null || sent.length != px.length ) return px.length;
+  int cnt = 0;
+  for( int i=0; i< px.length; i++ ) {
+    if( sent[i] != px[i] ) cnt++;
+  }
+  return cnt;
+}
+
+// send raw command bytes to the CtrlM, like "linkm.sh --cmd"
+void ctrlmCommand( byte[] cmd ) throws IOException {
+  linkm.commandi2c( ctrlmaddr, cmd, 0 );
+}
+
 // simple stupid helper class to run uploader in another thread
 class Uploader implements Runnable {
   public void run() {
@@ -555,6 +603,7 @@ boolean connectIfNeeded() {
       return false;
     }
     linkm.pause(200);  // FIXME: do we need this? 
+    sentpx = new int[btncnt][];  // FreeMs may have been reset meanwhile
     isConnected = true;
   }
   return true; // connect successful
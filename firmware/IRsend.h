@@ -25,6 +25,7 @@
 #define SONY_BITS 12
 
 // this gives us a transmit rate of ~771 bits/second. 
+// used by CtrlM frames in IR_MODE_FAST
 #define DATA_HDR_MARK   240
 #define DATA_HDR_SPACE  30
 #define DATA_ZERO_MARK  30
@@ -32,6 +33,15 @@
 #define DATA_ONE_MARK   60
 #define DATA_ONE_SPACE  30
 
+// pulse-position timing for CtrlM frames in IR_MODE_PPM:
+// every mark is the same, and each space after it carries 2 bits,
+// PPM_SPACE + (0..3)*PPM_SPACE_STEP long.  A stop mark ends the last space.
+#define PPM_HDR_MARK    240
+#define PPM_HDR_SPACE   120
+#define PPM_MARK        30
+#define PPM_SPACE       30
+#define PPM_SPACE_STEP  30
+
 //#define Data0_Time_ON   30    // carrier on time for data 0 (300uS)
 //#define Data0_Time_OFF  30    // carrier off time for data 0
 //#define Data1_Time_ON   60    // carrier on time for data 1 
@@ -43,30 +53,64 @@
 
 
 //#define freq_to_timer0val(x) ((F_CPU / x - 1)/ 2)
-#define freq_to_timer1val(x) ((F_CPU / x) - 1 )
+#define freq_to_timer1val(x) ((F_CPU / IR_TIMER1_PRESCALE / x) - 1 )
+
+// Timer0 runs free for both 'script_tick' and IR symbol timing.
+// Its clock is picked from F_CPU so one tick is about 1 usec (or less),
+// and all mark & space lengths are counted in its ticks.
+#if F_CPU > 1000000
+#define IR_TIMER0_PRESCALE 8
+#define IR_TIMER0_CS       _BV(CS01)
+#else
+#define IR_TIMER0_PRESCALE 1
+#define IR_TIMER0_CS       _BV(CS00)
+#endif
+
+// timer0 ticks in 10usec, the unit all the pulse parameters are in
+#define IR_TICKS_PER_TEN_US (F_CPU / IR_TIMER0_PRESCALE / 100000)
+
+#if IR_TICKS_PER_TEN_US == 0
+#error "F_CPU too slow for IR timing"
+#endif
+
+// Timer1 makes the carrier, its period in the 8-bit ir_freqval, so above
+// 8MHz (16MHz for the tiny84's phase correct mode) it's clocked slower.
+#if defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || \
+      defined(__AVR_ATtiny85__)
+#if F_CPU > 16000000
+#define IR_TIMER1_PRESCALE 4
+#define IR_TIMER1_CS       (_BV(CS11) | _BV(CS10))
+#elif F_CPU > 8000000
+#define IR_TIMER1_PRESCALE 2
+#define IR_TIMER1_CS       _BV(CS11)
+#else
+#define IR_TIMER1_PRESCALE 1
+#define IR_TIMER1_CS       _BV(CS10)
+#endif
+#elif defined(__AVR_ATtiny24__) || defined(__AVR_ATtiny44__) || \
+      defined(__AVR_ATtiny84__)
+#if F_CPU > 16000000
+#define IR_TIMER1_PRESCALE 8
+#define IR_TIMER1_CS       _BV(CS11)
+#else
+#define IR_TIMER1_PRESCALE 1
+#define IR_TIMER1_CS       _BV(CS10)
+#endif
+#endif
 
-// Shortcut to insert single, non-optimized-out nop
-#define NOP __asm__ __volatile__ ("nop")
-// Tweak this if neccessary to change timing
-#define DELAY_CNT 11
+static uint8_t ir_edge;   // timer0 count at the last mark/space edge
 
-// This function delays the specified number of 10 microseconds
-// it is 'hardcoded' and is calibrated by adjusting DELAY_CNT 
-// in main.h Unless you are changing the crystal from 8mhz, dont
-// mess with this.
+// This function delays the specified number of 10 microseconds.
+// It counts timer0 ticks from the last edge, not from when it was called,
+// so interrupts and call overhead don't make marks & spaces drift.
+// Call IRsend_enableIROut() first to set the starting edge.
 static void delay_ten_us(uint16_t us)
 {
-  uint8_t timer;
-  while (us != 0) {
-    // for 8MHz we want to delay 80 cycles per 10 microseconds
-    // this code is tweaked to give about that amount.
-    for (timer=0; timer <= DELAY_CNT; timer++) {
-      NOP;
-      NOP;
+    while (us != 0) {
+        ir_edge += IR_TICKS_PER_TEN_US;
+        while( (int8_t)(TCNT0 - ir_edge) < 0 ) ;
+        us--;
     }
-    NOP;
-    us--;
-  }
 }
 
 //
@@ -130,6 +174,7 @@ static void IRsend_space(uint16_t time)
 // OCR1B = OCR1C/2
 static void IRsend_enableIROut(void) 
 {
+    ir_edge = TCNT0;  // delay_ten_us() counts from here
 
     //const int freq = freq_to_timer1val( hz );
 
@@ -142,7 +187,7 @@ static void IRsend_enableIROut(void)
     //OCR0B = ir_freqval; 
 
     GTCCR = 0;
-    TCCR1 = _BV(PWM1A) | _BV(CS10);
+    TCCR1 = _BV(PWM1A) | IR_TIMER1_CS;
     OCR1C = ir_freqval;
     OCR1A = ir_dutyval; ///OCR1C / 3; // 33% duty cycle
     //OCR1A = OCR1C / 4; // 25% duty cycle
@@ -163,7 +208,7 @@ static void IRsend_enableIROut(void)
 
     // pwm, phase & frequency correct, ICR1 = TOP
     TCCR1A = _BV(COM1B1) | _BV(WGM10);
-    TCCR1B = _BV(WGM13) | _BV(CS10) ; //| _BV(CS10);
+    TCCR1B = _BV(WGM13) | IR_TIMER1_CS;
            
     // supposedly: Foc = fclk / (2*N*top)
     // or, Foc = F_CPU/( 2 * 1 * OCR1A ) =  8e6/(2*1*0x65) = 39.6 kHz
@@ -174,218 +219,622 @@ static void IRsend_enableIROut(void)
 
 }
 
-// From IRremote.cpp
-static void IRsend_sendSony(uint32_t data, uint16_t nbits)
+// ------------------------------------------------------------
+// Table-driven sender for other IR remote protocols, used by '$'
+//
+// Each protocol is a PROGMEM ir_protocol: optional header mark & space,
+// some '1' start bits, 'bits' data bits MSB first, optional trailer mark.
+// Bits are sent one of two ways:
+//  IR_STYLE_PULSE   -- a mark then a space, each long or short (Sony is 
+//                      pulse-width, NEC pulse-distance, same thing here)
+//  IR_STYLE_BIPHASE -- manchester, mark then space of 'one_mark' each for
+//                      a 1, space then mark for a 0 (RC6), or the other 
+//                      way around with IR_STYLE_BIPHASE_INV (RC5)
+// Adding a protocol is adding a line to ir_protocols[].
+// These block, and use the same carrier as CtrlM frames unless 'freqval'
+// is set, so only call them when the frame transmitter is idle.
+
+// timer1 value for a carrier of khz kHz, see IRsend_enableIROut()
+#if defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || \
+      defined(__AVR_ATtiny85__)
+#define carrier_to_freqval(khz) (F_CPU / IR_TIMER1_PRESCALE / 1000 / (khz) - 1)
+#elif defined(__AVR_ATtiny24__) || defined(__AVR_ATtiny44__) || \
+      defined(__AVR_ATtiny84__)
+#define carrier_to_freqval(khz) (F_CPU / IR_TIMER1_PRESCALE / 1000 / 2 / (khz))
+#endif
+
+#if carrier_to_freqval(36) > 255
+#error "F_CPU too fast for the IR carrier, add an IR_TIMER1_PRESCALE"
+#endif
+
+#define IR_STYLE_PULSE       0
+#define IR_STYLE_BIPHASE     1
+#define IR_STYLE_BIPHASE_INV 2
+
+#define IR_NO_WIDE_BIT 0xff
+
+// pulse parameters in tens of usec, 0 == not sent
+typedef struct _ir_protocol {
+    uint16_t hdr_mark;
+    uint16_t hdr_space;
+    uint16_t one_mark;       // half-bit for IR_STYLE_BIPHASE*
+    uint16_t one_space;
+    uint16_t zero_mark;
+    uint16_t zero_space;
+    uint16_t trail_mark;
+    uint8_t  style;          // one of IR_STYLE_*
+    uint8_t  bits;           // data bits, up to 32
+    uint8_t  start_bits;     // '1' bits sent before the data
+    uint8_t  wide_bit;       // data bit sent double-width (RC6 trailer bit)
+    uint8_t  freqval;        // carrier_to_freqval(), 0 == use ir_freqval
+} ir_protocol;
+
+// protocol types for '$'
+#define IR_PROTO_SONY  0
+#define IR_PROTO_RC5   1
+#define IR_PROTO_NEC   2
+#define IR_PROTO_RC6   3
+#define IR_PROTO_COUNT 4
+
+static const ir_protocol ir_protocols[IR_PROTO_COUNT] PROGMEM = {
+    { SONY_HDR_MARK, SONY_HDR_SPACE, SONY_ONE_MARK, SONY_HDR_SPACE, 
+      SONY_ZERO_MARK, SONY_HDR_SPACE, 0,
+      IR_STYLE_PULSE, SONY_BITS, 0, IR_NO_WIDE_BIT, 
+      carrier_to_freqval(40) },                            // IR_PROTO_SONY
+    { 0, 0, RC5_T1, 0, 0, 0, 0,
+      IR_STYLE_BIPHASE_INV, 12, 2, IR_NO_WIDE_BIT, 
+      carrier_to_freqval(36) },                            // IR_PROTO_RC5
+    { NEC_HDR_MARK, NEC_HDR_SPACE, NEC_BIT_MARK, NEC_ONE_SPACE,
+      NEC_BIT_MARK, NEC_ZERO_SPACE, NEC_BIT_MARK,
+      IR_STYLE_PULSE, 32, 0, IR_NO_WIDE_BIT,
+      carrier_to_freqval(38) },                            // IR_PROTO_NEC
+    { RC6_HDR_MARK, RC6_HDR_SPACE, RC6_T1, 0, 0, 0, 0,
+      IR_STYLE_BIPHASE, 20, 1, 3, 
+      carrier_to_freqval(36) },                            // IR_PROTO_RC6
+};
+
+// public
+// Sends the low bits of data as an IR remote code of protocol type,
+// one of IR_PROTO_*.  Blocks until it's all sent.
+static void IRsend_sendCode(uint8_t type, uint32_t data)
 {
+    ir_protocol p;
+    uint8_t freqval = ir_freqval;
+    uint8_t dutyval = ir_dutyval;
+    uint16_t t;
+    uint8_t bit;
+
+    if( type >= IR_PROTO_COUNT ) 
+        return;
+    memcpy_P( &p, &ir_protocols[type], sizeof(ir_protocol) );
+
+    if( p.freqval ) {
+        ir_freqval = p.freqval;
+        ir_dutyval = p.freqval / 3;  // 33% duty cycle
+    }
     IRsend_enableIROut();
-    IRsend_mark(SONY_HDR_MARK);
-    IRsend_space(SONY_HDR_SPACE);
-    data = data << (32 - nbits);
-    for (int i = 0; i < nbits; i++) {
-        if (data & TOPBIT) {
-            IRsend_mark(SONY_ONE_MARK);
-            IRsend_space(SONY_HDR_SPACE);
-        } 
-        else {
-            IRsend_mark(SONY_ZERO_MARK);
-            IRsend_space(SONY_HDR_SPACE);
+
+    if( p.hdr_mark )  IRsend_mark( p.hdr_mark );
+    if( p.hdr_space ) IRsend_space( p.hdr_space );
+
+    data <<= (32 - p.bits);
+    for( uint8_t i=0; i < p.start_bits + p.bits; i++ ) {
+        if( i < p.start_bits ) {
+            bit = 1;
+        } else {
+            bit = (data & TOPBIT) ? 1 : 0;
+            data <<= 1;
+        }
+        if( p.style == IR_STYLE_PULSE ) {
+            if( bit ) {
+                IRsend_mark( p.one_mark );
+                IRsend_space( p.one_space );
+            } else {
+                IRsend_mark( p.zero_mark );
+                IRsend_space( p.zero_space );
+            }
+        } else {
+            t = p.one_mark;
+            if( i - p.start_bits == p.wide_bit ) 
+                t <<= 1;
+            if( p.style == IR_STYLE_BIPHASE_INV ) 
+                bit = !bit;
+            if( bit ) {
+                IRsend_mark( t );
+                IRsend_space( t );
+            } else {
+                IRsend_space( t );
+                IRsend_mark( t );
+            }
         }
-        data <<= 1;
     }
+    if( p.trail_mark ) IRsend_mark( p.trail_mark );
+    IRsend_space(0);
+
+    ir_freqval = freqval;
+    ir_dutyval = dutyval;
 }
+
+// ------------------------------------------------------------
+// Interrupt-driven transmitter for CtrlM data frames
+//
+// Timer0 runs free at CLK/IR_TIMER0_PRESCALE.  Its overflow still makes
+// 'script_tick' (see ctrlm.c), and its compare A match walks
+// the frame one mark or space at a time, so handle_i2c() & friends keep
+// running while a frame is on the air.  Poll IRsend_isBusy() to find out
+// when it's done.
+//
+// There are IR_SLOTS frame slots.  While one is on the air, the main loop
+// can fill the others (IRsend_getSlot() / IRsend_sendSlot()), and the ISR
+// starts the next exactly ir_tm.gap (DATA_FRAME_GAP by default) after the
+// last space of the one before.
 //
-static void IRsend_sendSonyData4(uint32_t data )
+// IR receivers' AGC needs a rest after a run of frames, so with ir_tm.burst
+// set, every burst-th frame is followed by ir_tm.recover instead of the gap.
+// If the queue runs dry mid-burst, the ISR keeps counting the idle time,
+// and the budget only refills after a full recover time without frames.
+//
+// With IRsend_setRepeats(n), each slot goes out n times before it's freed.
+// The ISR goes round-robin over the ready slots, so copies of one frame
+// are spread out in time between copies of the others, and one burst of
+// interference (someone walking by) doesn't take out every copy:
+//   A1 B1 C1 A2 B2 C2 A3 ...  instead of  A1 A2 A3 B1 ...
+// Slots are filled in order and the oldest goes first, so the first 
+// copies still go out in the order the frames were queued.  Later copies
+// don't though, so if the first copy of an older frame was lost, a copy
+// of it could be taken after a newer one for the same thing (an old fade
+// winning).  So each slot is told what its frame is for, as a range
+// (IRsend_sendSlotFor()), and the caller holds back a frame while 
+// IRsend_pendingFor() says an overlapping one still has copies to go.
+//
+// With IRsend_setStream(1), a frame that's ready when the one before it
+// ends doesn't wait out the gap or send a header mark: a sync mark 
+// (ir_tm.sync) and the header space go between them instead, and the 
+// receiver stays locked on the whole burst.  The stream ends with a gap
+// as usual when the slots run dry or the burst budget is used up.
+
+#define IR_MAX_STEP  250        // longest single step of OCR0A, in ticks
+
+#define IR_FRAME_LEN  8         // bytes in a standard CtrlM data frame
+#define IR_FRAME_MAX  28        // bytes in a slot, longest frame we send
+#define IR_SLOTS      3         // frame slots, sent round-robin (max 8)
+
+// time between frames, in tens of usec, must be longer than the
+// receiver's end-of-frame gap (_GAP == 3ms in IRremoteInt.h)
+#define DATA_FRAME_GAP  500
+
+// receiver AGC recovery after a burst of frames, in tens of usec
+// (notes.txt: receivers give up at 5ms spacing, are happy with 50ms)
+#define DATA_RECOVER_GAP 5000
+
+// mark between streamed frames, in tens of usec, told apart by length 
+// from data & header marks (CTRLM_SYNC_MARK in IRremoteInt.h)
+#define DATA_SYNC_MARK  180
+
+// transmitter states, what the next edge should be
+#define IR_TX_HDR_MARK  0
+#define IR_TX_HDR_SPACE 1
+#define IR_TX_SPACE     2
+#define IR_TX_MARK      3
+#define IR_TX_GAP       4
+#define IR_TX_STOP      5
+#define IR_TX_RECOVER   6
+
+// CtrlM frame timing modes, see IRsend_setMode()
+#define IR_MODE_SONY  0   // Sony timing, what every FreeM understands
+#define IR_MODE_FAST  1   // DATA_* timing, about twice the bits/second
+#define IR_MODE_PPM   2   // PPM_* timing, 2 bits per space, ~3x Sony
+#define IR_MODE_COUNT 3
+
+// mark & space lengths for CtrlM frame bits, in tens of usec.
+// All uint16_t, so a field can be got at by number, IR_TM_* below.
+typedef struct _ir_timing {
+    uint16_t hdr_mark;
+    uint16_t hdr_space;
+    uint16_t one_mark;
+    uint16_t zero_mark;
+    uint16_t space;          // after each bit
+    uint16_t space_step;     // PPM only: space grows this much per symbol
+    uint16_t gap;            // between frames
+    uint16_t burst;          // frames before a recover gap, 0 == no limit
+    uint16_t recover;        // gap after each burst
+    uint16_t sync;           // between frames when streaming
+} ir_timing;
+
+// ir_timing fields, for IRsend_getTiming() & IRsend_setTiming()
+#define IR_TM_HDR_MARK   0
+#define IR_TM_HDR_SPACE  1
+#define IR_TM_ONE_MARK   2
+#define IR_TM_ZERO_MARK  3
+#define IR_TM_SPACE      4
+#define IR_TM_SPACE_STEP 5
+#define IR_TM_GAP        6
+#define IR_TM_BURST      7    // a count of frames, not a time
+#define IR_TM_RECOVER    8
+#define IR_TM_SYNC       9
+// IR_TM_COUNT is in ctrlm_nonvol_data.h, it sizes the EEPROM copy too
+#if IR_TM_SYNC >= IR_TM_COUNT
+#error "IR_TM_COUNT in ctrlm_nonvol_data.h needs the new ir_timing field"
+#endif
+
+// longest time a field can be, so it fits ir_tx_wait in timer0 ticks
+#define IR_TM_MAX (0xffff / IR_TICKS_PER_TEN_US)
+
+static const ir_timing ir_timings[IR_MODE_COUNT] PROGMEM = {
+    { SONY_HDR_MARK, SONY_HDR_SPACE, SONY_ONE_MARK, SONY_ZERO_MARK,
+      SONY_HDR_SPACE, 0, 
+      DATA_FRAME_GAP, 0, DATA_RECOVER_GAP, DATA_SYNC_MARK }, // IR_MODE_SONY
+    { DATA_HDR_MARK, DATA_HDR_SPACE, DATA_ONE_MARK, DATA_ZERO_MARK,
+      DATA_ZERO_SPACE, 0,
+      DATA_FRAME_GAP, 0, DATA_RECOVER_GAP, DATA_SYNC_MARK }, // IR_MODE_FAST
+    { PPM_HDR_MARK, PPM_HDR_SPACE, PPM_MARK, PPM_MARK,
+      PPM_SPACE, PPM_SPACE_STEP, 
+      DATA_FRAME_GAP, 0, DATA_RECOVER_GAP, DATA_SYNC_MARK }, // IR_MODE_PPM
+};
+
+#if defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || \
+      defined(__AVR_ATtiny85__)
+#define IR_TIMSK TIMSK
+#define IR_TIFR  TIFR
+#elif defined(__AVR_ATtiny24__) || defined(__AVR_ATtiny44__) || \
+      defined(__AVR_ATtiny84__)
+#define IR_TIMSK TIMSK0
+#define IR_TIFR  TIFR0
+#endif
+
+static uint8_t  ir_slot[IR_SLOTS][IR_FRAME_MAX]; // frames, ISR owns ready ones
+static uint8_t  ir_slot_len[IR_SLOTS];   // bytes in each slot's frame
+static volatile uint8_t ir_slot_ready;   // bit per slot, 1 == waiting or sending
+static uint8_t  ir_slot_fill;            // slot main loop fills next
+static uint8_t  ir_slot_send;            // slot ISR sends next, or is sending
+static uint8_t  ir_slot_copies[IR_SLOTS];// times each slot's been sent
+static uint8_t  ir_slot_for[IR_SLOTS][2];// lo,hi of what each frame is for
+static volatile uint8_t ir_tx_busy;      // 1 == frame or gap in progress
+static uint8_t  ir_tx_state;             // one of IR_TX_*
+static uint8_t* ir_tx_buf;               // frame being sent
+static uint8_t  ir_tx_pos;               // byte being sent
+static uint8_t  ir_tx_len;               // bytes in frame being sent
+static uint8_t  ir_tx_mask;              // bit being sent
+static uint8_t  ir_tx_sym;               // PPM only: 2 bits for next space
+static uint16_t ir_tx_wait;              // ticks left in this mark or space
+static uint8_t  ir_mode;                 // one of IR_MODE_*
+static ir_timing ir_tm;                  // timing for ir_mode
+static uint16_t ir_burst_left;           // frames until a recover gap
+static uint8_t  ir_repeats = 1;          // times each frame is sent
+static uint8_t  ir_stream;               // 1 == stream back-to-back frames
+
+// public
+static inline uint8_t IRsend_isBusy(void)
 {
-    uint8_t nbits = 32;
-    IRsend_enableIROut();
-    IRsend_mark(SONY_HDR_MARK);
-    IRsend_space(SONY_HDR_SPACE);
-    data = data << (32 - nbits);
-    for (int i = 0; i < nbits; i++) {
-        if (data & TOPBIT) {
-            IRsend_mark(SONY_ONE_MARK);
-            IRsend_space(SONY_HDR_SPACE);
-        } 
-        else {
-            IRsend_mark(SONY_ZERO_MARK);
-            IRsend_space(SONY_HDR_SPACE);
-        }
-        data <<= 1;
-    }
+    return ir_tx_busy;
 }
 
-// an experiment, in sending all 8-bytes at once
-// and it appears to work
-// THIS IS THE MAIN DATA SENDING FUNCTION
 // public
-static void IRsend_sendSonyData64bit(uint8_t* data )
+// 1 while a frame's marks & spaces are going out, 0 when idle or in the
+// gap after a frame (when the slot it came from is free again)
+static inline uint8_t IRsend_inFrame(void)
 {
-    //uint16_t wait_ten_us = wait_millis * 100; // convert millis to "10usecs" 
-
-    IRsend_enableIROut();
-    IRsend_mark(SONY_HDR_MARK);
-    IRsend_space(SONY_HDR_SPACE);
-
-    for( int i=0; i< 8; i++ ) {     // 8 bytes
-        uint8_t dat = data[i];
-        for( int j=0; j<8; j++ ) {  // 8 bits in a byte
-            if (dat & TOPBIT8) {
-                IRsend_mark(SONY_ONE_MARK);
-                IRsend_space(SONY_HDR_SPACE);
-            } 
-            else {
-                IRsend_mark(SONY_ZERO_MARK);
-                IRsend_space(SONY_HDR_SPACE);
-            }
-            dat <<= 1;
-        }
-    }
+    return ir_tx_busy && ir_tx_state != IR_TX_GAP;
+}
 
-    //if( wait_after) 
-    //    delay_ten_us( wait_ten_us );
+// public
+// Selects the timing used for CtrlM frames, one of IR_MODE_*.  
+// Only call when the transmitter is idle.
+static void IRsend_setMode(uint8_t mode)
+{
+    if( mode >= IR_MODE_COUNT ) 
+        return;
+    ir_mode = mode;
+    memcpy_P( &ir_tm, &ir_timings[mode], sizeof(ir_timing) );
+    ir_burst_left = ir_tm.burst;
 }
 
-//
-// This was the main workhorse for ctrlm data sending:
-// Send an 8-byte data buffer out, using two 32-bit (4-byte) packets
-static void IRsend_sendSonyData8(uint8_t* data, uint8_t wait_millis, uint8_t wait_after)
+// public
+// Returns timing field IR_TM_*, in tens of usec
+static uint16_t IRsend_getTiming(uint8_t field)
 {
-    uint16_t wait_ten_us = wait_millis * 100; // convert millis to "10usecs" 
-    uint32_t* dp0 = ((uint32_t*)(void*)data+0);
-    uint32_t* dp1 = ((uint32_t*)(void*)data+1);
+    if( field >= IR_TM_COUNT ) 
+        return 0;
+    return ((uint16_t*)(void*)&ir_tm)[field];
+}
 
-    IRsend_sendSonyData4( *dp0 );
-    delay_ten_us( wait_ten_us );
+// public
+// Changes timing field IR_TM_* from what IRsend_setMode() set, 
+// t in tens of usec, up to IR_TM_MAX.  0 is only taken for the fields
+// where it means off (BURST, RECOVER, SYNC), the marks & spaces keep
+// what they had.
+// Only call when the transmitter is idle.
+static void IRsend_setTiming(uint8_t field, uint16_t t)
+{
+    if( field >= IR_TM_COUNT ) 
+        return;
+    if( t == 0 && field < IR_TM_BURST ) 
+        return;
+    if( t > IR_TM_MAX ) 
+        t = IR_TM_MAX;
+    ((uint16_t*)(void*)&ir_tm)[field] = t;
+    ir_burst_left = ir_tm.burst;
+}
 
-    IRsend_sendSonyData4( *dp1 );
+// public
+// Sends every frame n times (1 == once, as usual).
+// Only call when the transmitter is idle.
+static void IRsend_setRepeats(uint8_t n)
+{
+    ir_repeats = n ? n : 1;
+}
 
-    if( wait_after) 
-        delay_ten_us( wait_ten_us );
+// public
+// With on set, back-to-back frames go out as one stream, a sync mark 
+// between them instead of the gap & header mark.  
+// Only call when the transmitter is idle.
+static void IRsend_setStream(uint8_t on)
+{
+    ir_stream = on;
 }
 
-// From IRremote.cpp
-void IRsend_sendNEC(uint32_t data, int nbits)
+// public
+// Time the len-byte frame in buf takes on the air, in tens of usec, from
+// the start of its header to the start of the next frame's: the header,
+// every bit's mark & space, a PPM stop mark, and the gap.  Streaming, it
+// is the sync mark before it instead of the header mark, stop & gap.
+// One copy, and not counting recover gaps.
+static uint32_t IRsend_airtime(uint8_t* buf, uint8_t len)
 {
-    IRsend_enableIROut();
-    IRsend_mark(NEC_HDR_MARK);
-    IRsend_space(NEC_HDR_SPACE);
-    for (int i = 0; i < nbits; i++) {
-        if (data & TOPBIT) {
-            IRsend_mark(NEC_BIT_MARK);
-            IRsend_space(NEC_ONE_SPACE);
-        } 
-        else {
-            IRsend_mark(NEC_BIT_MARK);
-            IRsend_space(NEC_ZERO_SPACE);
+    uint32_t t = ir_tm.hdr_space;
+    uint8_t b;
+    if( ir_stream ) 
+        t += ir_tm.sync;
+    else if( ir_tm.space_step ) 
+        t += ir_tm.hdr_mark + ir_tm.one_mark + ir_tm.gap;
+    else 
+        t += ir_tm.hdr_mark + ir_tm.gap;
+    for( uint8_t i=0; i<len; i++ ) {
+        b = buf[i];
+        for( uint8_t j=0; j<4; j++ ) {     // 2 bits at a time
+            if( ir_tm.space_step ) {       // PPM, 1 mark & space for both
+                t += ir_tm.one_mark + ir_tm.space;
+                if( b & 0x40 ) t += ir_tm.space_step;
+                if( b & 0x80 ) t += ir_tm.space_step << 1;
+            } else {
+                t += ir_tm.space << 1;
+                t += (b & 0x80) ? ir_tm.one_mark : ir_tm.zero_mark;
+                t += (b & 0x40) ? ir_tm.one_mark : ir_tm.zero_mark;
+            }
+            b <<= 2;
         }
-        data <<= 1;
     }
-    IRsend_mark(NEC_BIT_MARK);
-    IRsend_space(0);
+    return t;
 }
 
-// From IRremote.cpp
-// Note: first bit must be a one (start bit)
-void IRsend_sendRC5(uint32_t data, int nbits)
+// public
+// Airtime of everything in the slots still to go out, copies and all,
+// in tens of usec.  The frame on the air counts in full.
+static uint32_t IRsend_backlog(void)
 {
-    IRsend_enableIROut();  // 36);
-    data = data << (32 - nbits); // the first bit
-    IRsend_mark(RC5_T1);  // First start bit
-    IRsend_space(RC5_T1); // Second start bit
-    IRsend_mark(RC5_T1);  // Second start bit
-    for (int i = 0; i < nbits; i++) {
-        if (data & TOPBIT) {
-            IRsend_space(RC5_T1); // 1 is space, then mark
-            IRsend_mark(RC5_T1);
-        }
-        else {
-            IRsend_mark(RC5_T1);
-            IRsend_space(RC5_T1);
-        }
-        data <<= 1;
+    uint32_t t = 0;
+    uint8_t ready;
+    uint8_t copies[IR_SLOTS];
+    uint8_t sreg = SREG;
+    cli();                   // the ISR moves these on together
+    ready = ir_slot_ready;
+    memcpy( copies, ir_slot_copies, IR_SLOTS );
+    SREG = sreg;
+    for( uint8_t i=0; i<IR_SLOTS; i++ ) {
+        if( ready & _BV(i) ) 
+            t += IRsend_airtime( ir_slot[i], ir_slot_len[i] ) * 
+                (ir_repeats - copies[i]);
     }
-    IRsend_space(0); // Turn off at end
+    return t;
 }
 
-
-// From IRremote.cpp
-// Caller needs to take care of flipping the toggle bit
-void IRsend_sendRC6(unsigned long data, int nbits)
+// public
+// returns 1 if a slot with copies still to go holds a frame for anything
+// in lo..hi, so a frame for it now could be overtaken by one of them
+static uint8_t IRsend_pendingFor(uint8_t lo, uint8_t hi)
 {
-    IRsend_enableIROut(); //36);
-    data = data << (32 - nbits);
-    IRsend_mark(RC6_HDR_MARK);
-    IRsend_space(RC6_HDR_SPACE);
-    IRsend_mark(RC6_T1); // start bit
-    IRsend_space(RC6_T1);
-    int t;
-    for (int i = 0; i < nbits; i++) {
-        if (i == 3) {
-            t = 2 * RC6_T1;      // double-wide trailer bit
-        } 
-        else {
-            t = RC6_T1;
-        }
-        if (data & TOPBIT) {
-            IRsend_mark(t);
-            IRsend_space(t);
-        } 
-        else {
-            IRsend_space(t);
-            IRsend_mark(t);
-        }
-        data <<= 1;
+    uint8_t ready = ir_slot_ready;
+    if( ir_repeats == 1 )   // no later copies, frames go out in order
+        return 0;
+    for( uint8_t i=0; i<IR_SLOTS; i++ ) {
+        if( (ready & _BV(i)) && 
+            ir_slot_for[i][0] <= hi && lo <= ir_slot_for[i][1] ) 
+            return 1;
     }
-    IRsend_space(0); // Turn off at end
+    return 0;
 }
 
+// public
+// returns the next free frame slot to fill in, or 0 if all are in use
+static uint8_t* IRsend_getSlot(void)
+{
+    if( ir_slot_ready & _BV(ir_slot_fill) ) 
+        return 0;
+    return ir_slot[ir_slot_fill];
+}
 
-// from defcon-badge-16 ir.c
-static void IRsend_txByte(uint8_t val)
+// point the transmitter at the start of the frame in slot ir_slot_send
+static void IRsend_startSlot(void)
 {
-    uint8_t whichBit, temp;
-    
-    IRsend_enableIROut(); 
-    IRsend_mark( DATA_HDR_MARK );
-    IRsend_space( DATA_HDR_SPACE ); 
-    
-    whichBit = 0;
-    while (whichBit < 8) {
-        temp = 1 << whichBit;
-        
-        if ((val & temp) == 0) {
-            //ir_tx_data_0();
-            IRsend_mark(DATA_ZERO_MARK);
-            IRsend_space(DATA_ZERO_SPACE);
-        } else {
-            //ir_tx_data_1();
-            IRsend_mark(DATA_ONE_MARK);
-            IRsend_space(DATA_ONE_SPACE);
-        }
+    ir_tx_buf   = ir_slot[ir_slot_send];
+    ir_tx_len   = ir_slot_len[ir_slot_send];
+    ir_tx_pos   = 0;
+    ir_tx_mask  = TOPBIT8;
+    ir_tx_sym   = 0;
+    ir_tx_state = IR_TX_HDR_MARK;
+}
 
-        whichBit++;
+// moves ir_slot_send on to the next ready slot after it, round-robin,
+// returns 0 if there's none
+static uint8_t IRsend_nextSlot(void)
+{
+    for( uint8_t i=0; i<IR_SLOTS; i++ ) {
+        if( ++ir_slot_send == IR_SLOTS ) 
+            ir_slot_send = 0;
+        if( ir_slot_ready & _BV(ir_slot_send) ) 
+            return 1;
     }
+    return 0;
 }
-// send a buffer, e.g.
-// IRsend_txBuff( {'c', 0xff,0xff,0xff}, 4 );
-static void IRsend_txBuff(uint8_t *buf, int len)
+
+// public
+// Hands the slot from IRsend_getSlot(), holding a len-byte frame for
+// lo..hi (see IRsend_pendingFor()), to the transmitter.
+// If the transmitter is idle it starts right away, otherwise the ISR 
+// picks it up when the frame before it (and its gap) is done.
+static void IRsend_sendSlotFor(uint8_t len, uint8_t lo, uint8_t hi)
+{
+    uint8_t sreg = SREG;
+    ir_slot_for[ir_slot_fill][0] = lo;
+    ir_slot_for[ir_slot_fill][1] = hi;
+    cli();
+    ir_slot_len[ir_slot_fill] = len;
+    ir_slot_ready |= _BV(ir_slot_fill);
+    if( !ir_tx_busy ) {
+        ir_slot_send = ir_slot_fill;
+        IRsend_enableIROut();
+        IRsend_startSlot();
+        ir_tx_wait = 0;
+        ir_tx_busy = 1;
+        OCR0A = TCNT0 + 8;       // first edge (header mark) a few usec out
+        IR_TIFR   = _BV(OCF0A);  // clear any stale compare match
+        IR_TIMSK |= _BV(OCIE0A); // and let the ISR take it from here
+    }
+    ir_slot_fill = (ir_slot_fill + 1) % IR_SLOTS;
+    SREG = sreg;
+}
+
+// public
+// Same, for a frame that could be for anything
+static void IRsend_sendSlot(uint8_t len)
+{
+    IRsend_sendSlotFor( len, 0, 0xff );
+}
+
+// THIS IS THE MAIN DATA SENDING FUNCTION
+// public
+// Sends an 8-byte CtrlM frame, using a modified 64-bit version of the
+// Sony IR protocol (with timing from IRsend_setMode()), and returns 
+// right away.  The frame is copied, so the
+// caller can reuse its buffer.  If all slots are in use, waits for one.
+static void IRsend_sendSonyData64bit(uint8_t* data )
 {
-    for( int i=0; i<len; i++) {
-        IRsend_txByte(*buf);
-        buf++;
-        _delay_ms(3); 
-        // need delay in between bytes to prevent IR receiver from locking up
-  }	
+    uint8_t* slot;
+    while( (slot = IRsend_getSlot()) == 0 ) ;
+
+    memcpy( slot, data, IR_FRAME_LEN );
+    IRsend_sendSlot( IR_FRAME_LEN );
 }
-// from defcon-badge-16 ir.c
-static void IRsend_txString(uint8_t *Array_to_send)
+
+//
+// Frame transmitter
+// Called on every timer0 compare A match while a frame is being sent.
+// Turns the carrier on or off at each edge and schedules the next one.
+// OCR0A is only 8 bits, so long marks & spaces are done in several steps,
+// each relative to the last compare value, so no error piles up.
+//
+ISR(SIG_OUTPUT_COMPARE0A)
 {
-  while(*Array_to_send != '\0')	{
-	  IRsend_txByte(*Array_to_send);
-      Array_to_send++;
-      _delay_ms(3);
-      // need delay in between bytes to prevent IR receiver from locking up
-  }	
+    uint16_t t;
+    uint8_t step;
+
+    if( ir_tx_wait == 0 ) {          // this mark or space is done
+        switch( ir_tx_state ) {
+        case IR_TX_HDR_MARK:
+            IRsend_iron();
+            t = ir_tm.hdr_mark;
+            ir_tx_state = IR_TX_HDR_SPACE;
+            break;
+        case IR_TX_HDR_SPACE:
+            IRsend_iroff();
+            t = ir_tm.hdr_space;
+            ir_tx_state = IR_TX_MARK;
+            break;
+        case IR_TX_SPACE:
+            IRsend_iroff();
+            t = ir_tm.space;
+            if( ir_tx_sym & 1 ) t += ir_tm.space_step;  // no mul on tiny
+            if( ir_tx_sym & 2 ) t += ir_tm.space_step << 1;
+            ir_tx_state = IR_TX_MARK;
+            break;
+        case IR_TX_MARK:
+            if( ir_tx_pos < ir_tx_len ) {
+                IRsend_iron();
+                if( ir_tm.space_step ) {   // PPM, next 2 bits go in the space
+                    ir_tx_sym = ((ir_tx_buf[ir_tx_pos] & ir_tx_mask) ? 2:0) |
+                        ((ir_tx_buf[ir_tx_pos] & (ir_tx_mask>>1)) ? 1:0);
+                    t = ir_tm.one_mark;
+                    ir_tx_mask >>= 2;
+                } else {                   // bit is in the mark
+                    t = (ir_tx_buf[ir_tx_pos] & ir_tx_mask) ? 
+                        ir_tm.one_mark : ir_tm.zero_mark;
+                    ir_tx_mask >>= 1;
+                }
+                if( ir_tx_mask == 0 ) {  // on to next byte
+                    ir_tx_mask = TOPBIT8;
+                    ir_tx_pos++;
+                }
+                ir_tx_state = IR_TX_SPACE;
+                break;
+            }
+            // all bits sent, this copy of the slot is done
+            if( ++ir_slot_copies[ir_slot_send] >= ir_repeats ) { 
+                ir_slot_copies[ir_slot_send] = 0;     // all copies sent, so
+                ir_slot_ready &=~ _BV(ir_slot_send);  // slot can be refilled
+            }
+            if( ir_stream && ir_burst_left != 1 && IRsend_nextSlot() ) {
+                if( ir_tm.burst )    // streaming, and more is ready: a sync
+                    ir_burst_left--; // mark (ends a PPM space too), and on
+                IRsend_startSlot();  // to the next frame's header space
+                IRsend_iron();
+                t = ir_tm.sync;
+                ir_tx_state = IR_TX_HDR_SPACE;
+                break;
+            }
+            if( ir_tm.space_step ) {   // PPM, stop mark to end last space
+                IRsend_iron();
+                t = ir_tm.one_mark;
+                ir_tx_state = IR_TX_STOP;
+                break;
+            }
+            // fall through, last space done, all sent
+        case IR_TX_STOP:
+            IRsend_iroff();
+            t = ir_tm.gap;
+            if( ir_tm.burst && --ir_burst_left == 0 ) { // burst used up
+                t = ir_tm.recover;
+                ir_burst_left = ir_tm.burst;
+            }
+            ir_tx_state = IR_TX_GAP;
+            break;
+        case IR_TX_RECOVER:          // idle long enough, receivers rested
+            ir_burst_left = ir_tm.burst;
+            IR_TIMSK &=~ _BV(OCIE0A);
+            return;
+        default:                     // IR_TX_GAP
+            if( !IRsend_nextSlot() ) {    // nothing next
+                ir_tx_busy = 0;
+                if( ir_burst_left != ir_tm.burst &&   // mid-burst, so
+                    ir_tm.recover > ir_tm.gap ) {     // count idle time
+                    t = ir_tm.recover - ir_tm.gap;
+                    ir_tx_state = IR_TX_RECOVER;
+                    break;
+                }
+                IR_TIMSK &=~ _BV(OCIE0A);
+                return;
+            }
+            IRsend_startSlot();      // next frame, header mark right now
+            IRsend_iron();
+            t = ir_tm.hdr_mark;
+            ir_tx_state = IR_TX_HDR_SPACE;
+            break;
+        }
+        ir_tx_wait = t * IR_TICKS_PER_TEN_US;
+    }
+
+    step = (ir_tx_wait > IR_MAX_STEP) ? IR_MAX_STEP : ir_tx_wait;
+    OCR0A += step;
+    ir_tx_wait -= step;
 }
 
 // from IRremote.cpp
@@ -17,14 +17,114 @@
  * First, there are a few CtrlM-only commands:
  * {'@', freem_addr, blinkm_addr, 0 } -- set freem & blinkm addr to send to
  * {'#', freq_msb, freq_lsb, duty_percent }  -- set IR freq in kHz
- * //{'&', pair_msec, wait_after, } -- set time between 4-byte packets, FIXME
+ * {'&', field, t_msb, t_lsb } -- set CtrlM frame timing field (IR_TM_*)
  * {'$', cmd_type,cmd3,cmd2,cmd1,cmd0}--send IR remote cmd (cmd_type=sony,nec,)
+ *      cmd_type is one of IR_PROTO_* (0=sony,1=rc5,2=nec,3=rc6) in IRsend.h,
+ *      cmd3-cmd0 the code, MSB first, only the protocol's low bits are used
  * {'!',  freemaddr, blinkmaddr, cmd,arg1,arg2,arg3, 0,chksum} -- send arb data
+ * {'~', option, value, 0 }  -- set CtrlM option (OPT_* below)
+ * {'~', option, bits, OPT_BITS_ON } -- set just those bits of option
+ * {'+', groups_msb, groups_lsb, 0 } -- put FreeM freem_addr in groups
+ * {'=', pos, base_addr, n, n x {r,g,b} } -- set colorspot pos of n FreeMs
+ * {':', idx, r,g,b }       -- set palette color idx (0-15) of FreeM freem_addr
+ * {'>', src_pos, dst_pos, 0 } -- copy colorspot src_pos to dst_pos on FreeMs
+ * {'?'}  -- get IR backlog & last cmd's airtime, 3 bytes each, usec, msb 1st,
+ *          then how many replies were dropped since the last '?'
+ * {'M', vaddr, freem_addr, blinkm_addr } -- set where i2c addr+vaddr sends to
+ * {'M', 0, count, 0 }   -- answer count i2c addrs, i2c addr & up (default 1)
+ * {'{', type, id, base, n, n x item } -- bulk write n items (BULK_* below)
+ *
+ * The '&' timing fields are in tens of usec, and start out as the 
+ * built-in timing of the IR mode.  0 turns off IR_TM_BURST, IR_TM_RECOVER
+ * and IR_TM_SYNC, and is ignored for the others, the marks & spaces.
+ * Some 'field' values are special:
+ * {'&', TIMING_SAVE, 0,0 }     -- save IR mode & timing to EEPROM, for boot
+ * {'&', TIMING_DEFAULTS, 0,0 } -- back to built-in timing, forget saved one
+ * {'&', TIMING_READ|field,0,0} -- read back field, 2 bytes, msb first
+ * Changing the IR mode with '~' also goes back to built-in timing.
+ *
+ * Frame pacing is the CtrlM's job, not the host's: frames are at least the
+ * IR_TM_GAP field apart, and if IR_TM_BURST is set, every that-many frames 
+ * are followed by IR_TM_RECOVER instead, so receivers' AGC can settle.
+ * So a host can queue commands as fast as i2c goes.
+ *
+ * With {'~', OPT_STREAM, 1, 0}, frames queued back-to-back go out as one 
+ * stream: instead of the gap and the next frame's header mark, there's a
+ * sync mark (the IR_TM_SYNC field, 1.8ms) then the header space.  A
+ * receiver locks on at the first sync mark and stays locked until the 
+ * gap that ends the burst, which comes when the queue runs dry or after
+ * IR_TM_BURST frames.  For bulk uploads like colorspots, that saves the
+ * gap & header on all but the first frame.  Old FreeMs only get the first.
+ *
+ * FreeMs can be in any of 16 groups, bit g of the 16-bit mask set with 
+ * '+' for group g.  The FreeM keeps its mask.  Setting freem_addr to 
+ * 0xf0|g with '@' then sends to all FreeMs in group g with one frame, 
+ * so a FreeM's own address can't be 0xf0 or above.  (0 is still all.)
+ *
+ * '=' sets colorspot pos of FreeMs base_addr to base_addr+n-1 in one i2c
+ * write, the i-th r,g,b going to FreeM base_addr+i, like n '@' & '^' 
+ * pairs.  Keep each write to the host's i2c buffer (9 colors for Wire). 
+ * freem_addr & blinkm_addr are left alone.
+ *
+ * ':' sets color idx of a 16-color palette, both in the CtrlM and the
+ * FreeMs at freem_addr (usually 0, all of them).  It's for 
+ * {'~', OPT_IMAGE_ENC, IMG_ENC_PAL, 0}, see FRAME_IMAGE below.
+ *
+ * A host that wants FRAME_IMAGE only for a while, like for an upload, 
+ * sends {'~', OPT_SAVE, 0,0}, turns it on with OPT_BITS_ON so the other
+ * frame flags stay as they were, then {'~', OPT_RESTORE, 0,0} after.
+ *
+ * '{' is a bulk write of as many items as a host's i2c buffer holds, in
+ * one transaction, put in the IR send queue or EEPROM as they come in:
+ *   BULK_COLORSPOTS: id = colorspot pos, item = {r,g,b} for FreeM base+i,
+ *                    just like '='
+ *   BULK_SCRIPT:     id = script id (only 0, EEPROM), item = script line
+ *                    {dur,cmd,a1,a2,a3} for line base+i.  The script ends 
+ *                    after the last line written.
+ * The CtrlM holds SCL while it catches up, see below, so no host delays.
+ *
+ * '>' copies a whole image from one colorspot pos to another on the
+ * FreeMs at freem_addr, so a host can build a new image from one that's
+ * like it, with '=' only for the FreeMs whose color changes.
+ *
+ * '?' tells a host how long its commands keep the IR busy, worked out 
+ * from the frame bytes & timing like the transmitter does, so it can 
+ * pace itself without guessing.  First is the backlog, the time until
+ * everything queued is on the air, then the time the last command 
+ * queued takes, repeats & all.  Queued commands that aren't framed yet 
+ * count bytes SEQ & FEC will add as all 1s, so it's a little long.
+ * Recover gaps aren't counted.  Both max out at 0xffffff.
+ *
+ * The CtrlM can answer up to I2C_VADDRS i2c addresses, its own & the ones
+ * after.  By default it's just its own, so CtrlMs & BlinkMs at the next 
+ * addresses don't clash.  {'M', 0, count, 0} sets how many, in EEPROM.
+ * Commands to its own go to freem_addr & blinkm_addr as set by '@'.  
+ * Commands to the one vaddr up go to the {freem_addr, blinkm_addr} 'M' 
+ * stored in EEPROM for it, by default FreeM vaddr, all BlinkMs, so a host
+ * can talk to a FreeM without an '@' first.  '@' sent there doesn't stick.
  *
  * Second, some commands are not sent down the IR "wire". These commands are:
  * {'a' }       -- get i2c addr of CtrlM
  * {'A', addr}  -- set i2c addr of CtrlM
  *
+ * Commands are put together from the bytes as they come in, by the i2c 
+ * ISR, using cmd_arities[].  The main loop only gets whole commands, so
+ * a host that stops mid-command can't hold up scripts or IR; what it did 
+ * send is dropped at the next START.  '=' comes to the main loop one
+ * color at a time.  If 4 commands are waiting, the CtrlM holds SCL low
+ * until the main loop takes one, and the main loop waits for room in the
+ * IR send queue, so a host writing faster than IR can go is just slowed
+ * down, nothing gets lost.  The master must allow clock stretching, for
+ * as long as a frame takes (see '?').
+ *
+ * Replies ('?', 'a', 'Z', 'l', 'i', '&' read) are put in the i2c send 
+ * buffer for the master to read, and the CtrlM goes straight on.  If an
+ * unread one leaves no room for the whole of a new one, the new one is
+ * dropped and counted, see '?', so a host that asks & never reads can't
+ * hang the CtrlM, or get parts of two replies.  A read before the reply
+ * is ready, or after a dropped one, is NACKed, so a host can keep trying
+ * for a while, then throw away what's unread (see CtrlM_getAirtime()).
+ *
  * 
  * CtrlM IR protocol:
  * ------------------
@@ -41,6 +141,15 @@
  * byte6 -- blinkm_arg3 - blinkm arg3 (if not used, set to 0)
  * byte7 -- checksum    - simple 8-bit sum of bytes 0-6
  *
+ * Bits are sent MSB first, Sony-style: each bit is a mark (long for 1,
+ * short for 0) followed by a fixed space.  The mark & space lengths are
+ * either Sony timing (the default) or the shorter "fast data" timing,
+ * picked per CtrlM with {'~', OPT_IR_MODE, mode, 0}.  
+ * Mode 2 is pulse-position instead: every mark is the same short length 
+ * and each space after it carries 2 bits in one of four lengths, with a
+ * stop mark after the last space.  That's half the symbols per frame.
+ * (mode 0 == Sony, 1 == fast, 2 == ppm, see IR_MODE_* in IRsend.h)
+ *
  *
  * buffer layout is like:  (na == don't matter, set to zero)
  *                  buf[0], buf[1],     buf[2],      [3],  [4], [5], [6],  [7]
@@ -48,6 +157,68 @@
  *  write freemaddr: {0x55,  freem_addr, 0xff,        0xff, na,  na,  na,   chk}
  *  set colorspot:   {0x55,  freem_addr, 0xfe,        pos,  a1,  a2,  a3,   chk}
  *  play colorspot:  {0x55,  freem_addr, 0xfd,        pos, cmd,  na,  na,   chk}
+ *  set groups:      {0x55,  freem_addr, 0xfc,        g_msb,g_lsb,na, na,   chk}
+ *  short command:   {0x60|n,freem_addr, blinkm_addr, cmd,  a1..an,    chk}
+ *  aggregate:       {0x70|n,freem_addr, n x {blinkm_addr,cmd,a1,a2,a3}, chk}
+ *  context:         {0x40,  freem_addr, blinkm_addr, chk}
+ *  command only:    {0x30|n,cmd,        a1..an,      chk}
+ *  set palette:     {0x55,  freem_addr, 0xfb,        idx,  r,   g,   b,    chk}
+ *  copy colorspot:  {0x55,  freem_addr, 0xfa,        src,  dst, na,  na,   chk}
+ *  image:           {0x20|n,base_addr,  pos,  n x {r,g,b},       chk}
+ *  packed image:    {0x10|enc,base_addr,pos,  n, colors...,      chk}
+ *
+ * Short commands are only sent if FRAME_SHORT is set with
+ * {'~', OPT_FRAME_FLAGS, flags, 0}.  Then BlinkM commands with fewer than
+ * 3 args (n, from cmd_arity()) go out as 5-7 byte frames, the checksum
+ * right after the last arg.  Old FreeMs only know 0x55 frames.
+ * With FRAME_AGGREGATE set, commands to the same FreeM that pile up in 
+ * the send queue while a frame is on the air go out together in one 
+ * aggregate frame (up to FRAME_AGG_MAX of them), under one header, 
+ * start byte, freem_addr and checksum.  
+ *
+ * With FRAME_CONTEXT set, a context frame goes out when the FreeM & 
+ * BlinkM that commands are sent to changes (usually with '@'), and the
+ * commands after it go out as command-only frames, without addresses.
+ * Receivers keep the last context they got, and treat a command-only
+ * frame like a 0x55 one to that FreeM & BlinkM.  Full frames don't 
+ * change the context.  In case a receiver missed it, the context is 
+ * sent again every FRAME_CTX_REFRESH commands.  With repeats, a new
+ * context waits until every copy of the frames before it has gone out,
+ * so a late copy of a command-only frame can't land in the new context.
+ *
+ * With FRAME_IMAGE set, set colorspot frames queued one after another
+ * for the same pos and FreeMs base_addr, base_addr+1, ... go out as one
+ * image frame (up to FRAME_IMG_MAX of them), which every FreeM hears and
+ * the one at base_addr+i takes the i-th color from.  That's what '=' 
+ * queues, so a 10x10 grid's image is 17 frames instead of 100.  
+ * Only real FreeM addresses are packed, not 0 or groups.
+ * {'~', OPT_IMAGE_ENC, enc, 0} makes '=' send smaller colors instead, in
+ * packed image frames, enc in the start byte: 
+ *   IMG_ENC_565 -- RGB565, 2 bytes each, msb first, FRAME_565_MAX a frame
+ *   IMG_ENC_PAL -- the nearest palette color's index, 4 bits each, high
+ *                  nibble first, FRAME_PAL_MAX a frame
+ * '=' packs them as they come in, into queue entries with no checksum
+ * {0x10|enc, base_addr, pos, n, 4 bytes of colors}, and the entries that
+ * pile up get joined into one frame on the way out.  They're tagged in
+ * the queue, so a '!' frame starting with 0x1n still goes out as it is.  With 4-bit colors,
+ * a 10x10 grid's image is 4 frames.
+ *
+ * With FRAME_FEC set, any of the above goes out with the 0x80 bit set in
+ * its start byte, a CRC-8 (poly 0x07) instead of the 8-bit sum, and 
+ * parity so a receiver can fix a single flipped bit:
+ *   {start|0x80, ..., crc8, colpar, rowpar[(len+7)/8]}
+ * 'len' is the bytes up to and including crc8.  colpar is all of them 
+ * XORed together, and bit (0x80>>(i%8)) of rowpar[i/8] is the parity of
+ * byte i.  A bad row and a bad column point at the bit to flip, and the 
+ * CRC then says if the fix worked.  That's 2-4 more bytes per frame.
+ *
+ * With FRAME_SEQ set, a sequence number byte goes right after the start 
+ * byte, and the 0x08 bit is set in the start byte:
+ *   {start|0x08, seq, ...}   (before any FEC is added)
+ * seq goes up by one for each frame from the queue.  With OPT_REPEATS
+ * set to n, each frame goes on the air n times with the same seq, so 
+ * receivers can drop the copies they've already seen and n copies are 
+ * safe for relative commands too.  Use them together.
  *
  *
  * Some LinkM.sh commands to try: (0x21 == '!'):
@@ -77,7 +248,13 @@
  *   addr 1: boot mode 
  *   addr 2: script_id
  *   addr 3: script_reps
- *   addr 4: 
+ *   addr 4: boot fadespeed
+ *   addr 5: boot timeadj
+ *   addr 7: script len, reps, then EE_SCRIPT_LEN lines of 5 bytes
+ *   then:   IR mode, 0xff if no saved timing
+ *           IR timing, 10 x 16-bit
+ *           vaddr map, I2C_VADDRS x {freem addr, blinkm addr}
+ *           vaddr count, i2c addrs answered
  *
  *
  * CtrlM layout on ATtiny85
@@ -108,11 +285,67 @@
 
 #include "usiTwiSlave.h"
 
+#include "ringbuffer.h"
+
 #include "ctrlm_nonvol_data.h"
 
 #define BLINKM_PROTOCOL_VERSION_MAJOR 'b'
 #define BLINKM_PROTOCOL_VERSION_MINOR 'b'
 
+// options for the '~' command
+#define OPT_IR_MODE      0   // CtrlM frame timing, one of IR_MODE_*
+#define OPT_FRAME_FLAGS  1   // which frame formats to use, FRAME_* below
+#define OPT_REPEATS      2   // times to send each frame, default 1
+#define OPT_STREAM       3   // 1 == stream back-to-back frames, no gaps
+#define OPT_IMAGE_ENC    4   // how '=' sends colors, IMG_ENC_* below
+#define OPT_SAVE         5   // remember OPT_FRAME_FLAGS & OPT_IMAGE_ENC
+#define OPT_RESTORE      6   // go back to the ones OPT_SAVE remembered
+
+// last arg of '~', how to apply value
+#define OPT_SET          0   // replace the option with value
+#define OPT_BITS_ON      1   // OR value in, other bits are left alone
+
+// values for OPT_IMAGE_ENC
+#define IMG_ENC_RGB      0   // 3 bytes a color, set colorspot / image frames
+#define IMG_ENC_565      1   // RGB565, packed image frames
+#define IMG_ENC_PAL      2   // 4-bit palette index, packed image frames
+
+// types for '{' bulk write
+#define BULK_COLORSPOTS  0   // {r,g,b} items, colorspot of FreeM base+i
+#define BULK_SCRIPT      1   // script_line items, EEPROM script line base+i
+
+// bits for OPT_FRAME_FLAGS
+#define FRAME_SHORT      0x01 // send 0-2 arg commands as short frames
+#define FRAME_AGGREGATE  0x02 // send queued commands together in one frame
+#define FRAME_FEC        0x04 // add CRC-8 & parity to fix 1-bit errors
+#define FRAME_SEQ        0x08 // add a sequence number, for de-duplicating
+#define FRAME_CONTEXT    0x10 // send addresses once, then command-only frames
+#define FRAME_IMAGE      0x20 // send colorspots of FreeM runs as image frames
+
+// special 'field' values for the '&' command
+#define TIMING_SAVE      0x40 // save IR mode & timing to EEPROM
+#define TIMING_DEFAULTS  0x41 // built-in timing for the IR mode
+#define TIMING_READ      0x80 // | field, send field back over i2c
+
+#define FRAME_SHORT_START 0x60 // start byte of a short frame, | num args
+#define FRAME_AGG_START   0x70 // start byte of an aggregate frame, | num cmds
+#define FRAME_AGG_MAX     4    // most commands in an aggregate frame
+#define FRAME_FEC_BIT     0x80 // set in the start byte of an FEC frame
+#define FRAME_SEQ_BIT     0x08 // set in the start byte if seq follows it
+#define FRAME_CMD_START   0x30 // start byte of a command-only frame, | num args
+#define FRAME_CTX_START   0x40 // start byte of a context frame
+#define FRAME_CTX_REFRESH 16   // command-only frames before resending context
+#define FRAME_IMG_START   0x20 // start byte of an image frame, | num colors
+#define FRAME_IMG_MAX     6    // most colors in an image frame, to fit w/ FEC
+#define FRAME_ENC_START   0x10 // start byte of a packed image frame, | enc
+#define FRAME_565_MAX     8    // most RGB565 colors in a packed image frame
+#define FRAME_PAL_MAX     32   // most palette colors in a packed image frame
+#define FRAME_ENC_ENTRY(e) ((e) == IMG_ENC_565 ? 2 : 8) // colors a queue entry
+
+// timer0 overflows per script_tick, see ISR(SIG_OVERFLOW0)
+// (script_tick used to be timer0 overflow at CLK/1024)
+#define SCRIPT_TICK_DIV (1024/IR_TIMER0_PRESCALE)
+
 #if defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || \
       defined(__AVR_ATtiny85__)
 
@@ -165,12 +398,14 @@ uint8_t curr_script_reps;
 uint8_t curr_script_id;   // id number of script being run
 
 volatile uint8_t script_tick;       // incremented by interrupt
+uint16_t script_tick_div;           // timer0 overflows towards next tick
 script_line* script_addr;  // addr
 uint8_t script_pos;        // current position in a sequence
 
 // vars used when parsing either i2c or script playback
 uint8_t cmd;
-uint8_t cmdargs[8];
+uint8_t cmdargs[TWI_CMD_LEN-1];
+uint8_t i2c_dropped;       // i2c replies dropped since the last '?'
     
 
 uint8_t bigIinput = 0xff;
@@ -182,28 +417,80 @@ uint16_t wait_tick;   // big delay
 // ctrlm-only vals
 uint8_t blinkm_addr = 0x09;   // i2c address of blinkm on freem (0 = all)
 uint8_t freem_addr = 0x00;    // "address" of freem (0 = all)
+uint8_t ir_frame_flags = 0;   // FRAME_* bits, 0 = only standard frames
+uint8_t ir_seq;               // sequence number for FRAME_SEQ
+uint8_t ir_ctx[2];            // freem & blinkm addr of the last context frame
+uint8_t ir_ctx_left;          // command-only frames until it's resent, 0=now
+uint8_t ir_img_enc;           // IMG_ENC_* for '=', with FRAME_IMAGE
+uint8_t ir_saved_flags;       // ir_frame_flags & ir_img_enc at OPT_SAVE
+uint8_t ir_saved_enc;
+uint8_t ir_palette[16][3];    // r,g,b of the palette, for IMG_ENC_PAL
+uint32_t ir_last_airtime;     // of the last command queued, in tens of usec
+uint8_t ir_img_entry[8];      // packed image entry '=' is filling, [3]=colors
+uint8_t ir_packed_q;          // bit i set if queue entry i (0 oldest) is one
 
 uint8_t ir_freqval = DEFAULT_FREQVAL;  // for timer1, FIXME: use 
 uint8_t ir_dutyval = DEFAULT_FREQVAL/3;  // 33% duty cycle
 
-//static uint8_t packet_millis = 5; // time between 4-byte packets
-//static uint8_t wait_after = 0;    // 1 = wait packet_millis after sending
 
 #include "IRsend.h"
 
 
 // function prototypes
-static void read_i2c_vals(uint8_t num);
 static void handle_script_cmd(void);
 static void handle_i2c(void);
 static void script_get_next_line_ee(void);
+static void script_write_line_ee(uint16_t pos, uint8_t* buf, uint8_t last);
 static void script_do_next_line(void);
 static void play_script_ee(uint8_t reps);
 static void play_script(uint8_t script_id, uint8_t reps, uint8_t fadespeed);
 static void handle_script(void);
+static void handle_ir_queue(void);
+static uint32_t ir_entry_airtime(uint8_t* f);
+static uint8_t ir_frame_pending(uint8_t* f);
+static void ir_image_end(void);
 
 // ----------------------------------------------------
 
+// Number of arg bytes after each command byte on i2c, as pairs of
+// {cmd, num args}.  These are also the arities of BlinkM commands, 
+// used to size short frames.  Anything not here is assumed to take 3.
+// The i2c ISR uses them to put whole commands together, see handle_i2c().
+static const uint8_t cmd_arities[] PROGMEM = {
+    '@',3, '#',3, '%',3, '&',3, '~',3, '$',5, '!',8, '^',4, '*',3, '+',3,
+    '=',3|TWI_CMD_RUN(3), ':',4, '>',3, '{',4|TWI_CMD_RUN_BY_ARGS,
+    '?',0, 'M',3, 'a',0, 'A',4, 'Z',0, 'P',3, 'l',1, 'i',0,
+    'n',3, 'c',3, 'C',3, 'h',3, 'H',3, 'p',3, 'f',1, 't',1, 'o',0, 'O',0,
+    0
+};
+
+// look up the number of args cmd takes
+static uint8_t cmd_arity(uint8_t c)
+{
+    const uint8_t* p = cmd_arities;
+    uint8_t t;
+    while( (t = pgm_read_byte(p)) != 0 ) {
+        if( t == c ) 
+            return pgm_read_byte(p+1);
+        p += 2;
+    }
+    return 3;
+}
+
+// for usiTwiSlave.c's ISR, called with each command byte
+uint8_t usiTwiCmdArity(uint8_t c)
+{
+    return cmd_arity(c);
+}
+
+// for usiTwiSlave.c's ISR, called with '{' & its args, the size of an item
+uint8_t usiTwiCmdRunUnit(uint8_t* c)
+{
+    if( c[1] == BULK_COLORSPOTS ) return 3;
+    if( c[1] == BULK_SCRIPT ) return sizeof(script_line);
+    return 1;  // unknown type, skipped
+}
+
 // This function quickly pulses the visible LED 
 // NOTE: we can only flash quickly and not full-on because 
 // no current-limiting resistor on IR LED connected to same pin as stat LED
@@ -246,14 +533,485 @@ static inline uint8_t compute_checksum(uint8_t* buf, int c)
     }
     return chksum;
 }
+
+// queue up a ready-to-send 8-byte frame for the IR transmitter
+// if the queue is full, feed the transmitter until there's room
+static void ir_queue( uint8_t* cmdbuf )
+{
+    while( RB_IsFull() ) 
+        handle_ir_queue();
+    uint64_t* d = ((uint64_t*)(void*)cmdbuf);
+    RB_Write( *d );
+    ir_last_airtime = ir_entry_airtime( cmdbuf );
+}
+
+// queue up packed image entry e, tagged so it isn't taken for a frame 
+// from '!' with the same start byte
+static void ir_queue_packed( uint8_t* e )
+{
+    ir_queue( e );
+    ir_packed_q |= 1 << (RB_Entries - 1);
+}
+
+// take the oldest entry off the queue, after RB_Peek()
+static void ir_unqueue(void)
+{
+    RB_Read();
+    ir_packed_q >>= 1;
+}
+
+// how many bytes of a queued frame go on the air, from its start byte
+static uint8_t ir_frame_len( uint8_t* buf )
+{
+    if( (buf[0] & 0xf0) == FRAME_SHORT_START ) 
+        return 5 + (buf[0] & 0x03);
+    return IR_FRAME_LEN;
+}
+
+// Airtime of queued frame f, all copies, as it'd go out on its own, 
+// in tens of usec.  Bytes SEQ & FEC add aren't known yet, so count as 1s.
+static uint32_t ir_entry_airtime( uint8_t* f )
+{
+    uint8_t buf[IR_FRAME_MAX];
+    uint8_t len = ir_frame_len( f );
+    memset( buf, 0xff, IR_FRAME_MAX );
+    memcpy( buf, f, len );
+    if( ir_frame_flags & FRAME_SEQ ) 
+        len++;
+    if( ir_frame_flags & FRAME_FEC ) 
+        len += 1 + (len+7)/8;
+    return IRsend_airtime( buf, len ) * ir_repeats;
+}
+
+// time until everything queued has gone out, in tens of usec
+static uint32_t ir_backlog(void)
+{
+    uint64_t d;
+    uint32_t t = IRsend_backlog();
+    for( uint16_t i=0; i<RB_Entries; i++ ) {
+        d = RB_PeekAt( i );
+        t += ir_entry_airtime( (uint8_t*)(void*)&d );
+    }
+    return t;
+}
+
+// put tens of usec t in buf as usec, 3 bytes msb first, for an i2c reply
+static void ir_put_usecs( uint8_t* buf, uint32_t t )
+{
+    t = (t > 0xffffff/10) ? 0xffffff : t*10;
+    buf[0] = t >> 16;
+    buf[1] = t >> 8;
+    buf[2] = t & 0xff;
+}
+
+// 1 if the queued frame is a plain BlinkM command that can go in 
+// an aggregate frame
+static uint8_t ir_frame_is_cmd( uint8_t* buf )
+{
+    return buf[0] == 0x55 || (buf[0] & 0xf0) == FRAME_SHORT_START;
+}
+
+// copy the {blinkm_addr, cmd, a1,a2,a3} of queued frame buf to t,
+// zeroing any args a short frame doesn't have
+static void ir_agg_tuple( uint8_t* t, uint8_t* buf )
+{
+    uint8_t n = 3;
+    if( (buf[0] & 0xf0) == FRAME_SHORT_START ) 
+        n = buf[0] & 0x03;
+    t[0] = buf[2];
+    t[1] = buf[3];
+    for( uint8_t i=0; i<3; i++ ) 
+        t[2+i] = (i < n) ? buf[4+i] : 0;
+}
+
+// Packs queued frame first, and the commands to the same FreeM queued 
+// right after it, into one aggregate frame in slot.  
+// If there's nothing to join it with, first goes out as it is.
+// Returns the frame length.
+static uint8_t ir_aggregate( uint8_t* slot, uint8_t* first )
+{
+    uint64_t d;
+    uint8_t* next = (uint8_t*)(void*)&d;
+    uint8_t n = 1;
+    while( n < FRAME_AGG_MAX && !RB_IsEmpty() ) {
+        d = RB_Peek();
+        if( !ir_frame_is_cmd(next) || next[1] != first[1] ) 
+            break;
+        ir_unqueue();
+        ir_agg_tuple( slot + 2 + 5*n, next );
+        n++;
+    }
+    if( n == 1 ) {
+        memcpy( slot, first, IR_FRAME_LEN );
+        return ir_frame_len( slot );
+    }
+    ir_agg_tuple( slot + 2, first );
+    slot[0] = FRAME_AGG_START | n;
+    slot[1] = first[1];
+    n = 3 + 5*n;
+    slot[n-1] = compute_checksum( slot, n-1 );
+    return n;
+}
+
+// 1 if the queued frame is a set colorspot to one FreeM, that can go in
+// an image frame
+static uint8_t ir_frame_is_spot( uint8_t* buf )
+{
+    return buf[0] == 0x55 && buf[2] == 0xfe && buf[1] != 0 && buf[1] < 0xf0;
+}
+
+// Packs set colorspot frame first, and the ones queued right after it 
+// for the same pos & the next FreeMs up, into one image frame in slot.
+// If there's nothing to join it with, first goes out as it is.
+// Returns the frame length.
+static uint8_t ir_image( uint8_t* slot, uint8_t* first )
+{
+    uint64_t d;
+    uint8_t* next = (uint8_t*)(void*)&d;
+    uint8_t n = 1;
+    memcpy( slot + 3, first + 4, 3 );
+    while( n < FRAME_IMG_MAX && !RB_IsEmpty() ) {
+        d = RB_Peek();
+        if( !ir_frame_is_spot(next) || next[1] != first[1] + n || 
+            next[3] != first[3] || ir_frame_pending(next) ) 
+            break;
+        ir_unqueue();
+        memcpy( slot + 3 + 3*n, next + 4, 3 );
+        n++;
+    }
+    if( n == 1 ) {
+        memcpy( slot, first, IR_FRAME_LEN );
+        return IR_FRAME_LEN;
+    }
+    slot[0] = FRAME_IMG_START | n;
+    slot[1] = first[1];
+    slot[2] = first[3];
+    n = 4 + 3*n;
+    slot[n-1] = compute_checksum( slot, n-1 );
+    return n;
+}
+
+// bytes n colors take in a packed image frame with encoding enc
+static uint8_t ir_img_bytes( uint8_t enc, uint8_t n )
+{
+    return (enc == IMG_ENC_565) ? 2*n : (n+1)/2;
+}
+
+// Joins queued packed image entry first, and the ones right after it that
+// carry on where it stops, into one packed image frame in slot.
+// Only full entries are joined on to, so the colors stay back to back.
+// Returns the frame length.
+static uint8_t ir_image_packed( uint8_t* slot, uint8_t* first )
+{
+    uint64_t d;
+    uint8_t* next = (uint8_t*)(void*)&d;
+    uint8_t enc = first[0] & 0x07;
+    uint8_t max = (enc == IMG_ENC_565) ? FRAME_565_MAX : FRAME_PAL_MAX;
+    uint8_t n = first[3];
+    uint8_t k = n;                // colors in the last entry joined
+    memcpy( slot, first, IR_FRAME_LEN );
+    while( k == FRAME_ENC_ENTRY(enc) && !RB_IsEmpty() ) {
+        d = RB_Peek();
+        if( !(ir_packed_q & 1) || next[0] != first[0] || next[1] != first[1] + n || 
+            next[2] != first[2] || n + next[3] > max || 
+            ir_frame_pending(next) ) 
+            break;
+        ir_unqueue();
+        memcpy( slot + 4 + ir_img_bytes(enc, n), next + 4, 4 );
+        k = next[3];
+        n += k;
+    }
+    slot[3] = n;
+    n = 5 + ir_img_bytes(enc, n);
+    slot[n-1] = compute_checksum( slot, n-1 );
+    return n;
+}
+
+// index of the palette color nearest r,g,b in rgb
+static uint8_t ir_palette_match( uint8_t* rgb )
+{
+    uint8_t best = 0;
+    uint16_t bestd = 0xffff;
+    uint16_t dist;
+    int16_t t;
+    for( uint8_t i=0; i<16; i++ ) {
+        dist = 0;
+        for( uint8_t j=0; j<3; j++ ) {
+            t = rgb[j] - ir_palette[i][j];
+            dist += (t < 0) ? -t : t;
+        }
+        if( dist < bestd ) {
+            bestd = dist;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// put r,g,b in rgb as the i-th color of packed colors data, in enc
+static void ir_img_put( uint8_t* data, uint8_t i, uint8_t enc, uint8_t* rgb )
+{
+    uint8_t c;
+    if( enc == IMG_ENC_565 ) {
+        data[2*i]   = (rgb[0] & 0xf8) | (rgb[1] >> 5);
+        data[2*i+1] = ((rgb[1] & 0x1c) << 3) | (rgb[2] >> 3);
+    } else {
+        c = ir_palette_match( rgb );
+        data[i/2] |= (i & 1) ? c : c << 4;
+    }
+}
+
+// 1 if the queued frame buf goes to the FreeM & BlinkM of the context 
+// on the air, so can go out as a command-only frame
+static uint8_t ir_context_ok( uint8_t* buf )
+{
+    return ir_ctx_left != 0 && buf[1] == ir_ctx[0] && buf[2] == ir_ctx[1];
+}
+
+// Puts a context frame for the FreeM & BlinkM queued frame buf goes to
+// in slot.  Returns its length.
+static uint8_t ir_context( uint8_t* slot, uint8_t* buf )
+{
+    slot[0] = FRAME_CTX_START;
+    slot[1] = ir_ctx[0] = buf[1];
+    slot[2] = ir_ctx[1] = buf[2];
+    slot[3] = compute_checksum( slot, 3 );
+    ir_ctx_left = FRAME_CTX_REFRESH;
+    return 4;
+}
+
+// Turns the plain command frame in slot into a command-only frame, for
+// the context on the air.  Returns its length.
+static uint8_t ir_cmd_only( uint8_t* slot )
+{
+    uint8_t n = 3;
+    if( (slot[0] & 0xf0) == FRAME_SHORT_START ) 
+        n = slot[0] & 0x03;
+    memmove( slot+1, slot+3, 1+n );
+    slot[0] = FRAME_CMD_START | n;
+    slot[2+n] = compute_checksum( slot, 2+n );
+    ir_ctx_left--;
+    return 3+n;
+}
+
+// Puts the next sequence number after the start byte of the len-byte
+// frame in slot.  Returns the new length.
+static uint8_t ir_add_seq( uint8_t* slot, uint8_t len )
+{
+    memmove( slot+2, slot+1, len-1 );
+    slot[0] |= FRAME_SEQ_BIT;
+    slot[1] = ir_seq++;
+    len++;
+    slot[len-1] = compute_checksum( slot, len-1 );
+    return len;
+}
+
+// CRC-8, polynomial x^8+x^2+x+1 (0x07), bit at a time to save flash
+static uint8_t compute_crc8( uint8_t* buf, uint8_t len )
+{
+    uint8_t crc = 0;
+    while( len-- ) {
+        crc ^= *buf++;
+        for( uint8_t i=0; i<8; i++ ) 
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    }
+    return crc;
+}
+
+// Turns the len-byte frame in slot into an FEC frame, see top of file.
+// Returns the new length.
+static uint8_t ir_fec( uint8_t* slot, uint8_t len )
+{
+    uint8_t* colpar = slot + len;
+    uint8_t* rowpar = slot + len + 1;
+    uint8_t b;
+    slot[0] |= FRAME_FEC_BIT;
+    slot[len-1] = compute_crc8( slot, len-1 );
+    *colpar = 0;
+    memset( rowpar, 0, (len+7)/8 );
+    for( uint8_t i=0; i<len; i++ ) {
+        *colpar ^= slot[i];
+        b = slot[i] ^ (slot[i] >> 4);
+        b ^= b >> 2;
+        b ^= b >> 1;
+        if( b & 1 ) 
+            rowpar[i/8] |= 0x80 >> (i%8);
+    }
+    return len + 1 + (len+7)/8;
+}
+
+// Puts the FreeMs the len-byte frame f is for in r, as {lo, hi}, so it
+// isn't sent while copies of an older frame for any of them are still 
+// going out, see IRsend_pendingFor().  Works on queued frames and on 
+// framed ones before SEQ & FEC are added, packed is 1 if f is a packed
+// image.  0, groups, & frames it doesn't know are for all of them.
+static void ir_frame_for( uint8_t* f, uint8_t* r, uint8_t packed )
+{
+    uint8_t s = f[0] & 0xf0;
+    uint8_t n = 1;
+    r[0] = f[1];
+    if( s == FRAME_IMG_START ) 
+        n = f[0] & 0x0f;
+    else if( s == FRAME_ENC_START && packed ) 
+        n = f[3];
+    else if( s == FRAME_CMD_START ) 
+        r[0] = ir_ctx[0];
+    else if( f[0] != 0x55 && s != FRAME_SHORT_START && 
+             s != FRAME_AGG_START && s != FRAME_CTX_START ) 
+        r[0] = 0;
+    r[1] = r[0] + n - 1;
+    if( r[0] == 0 || r[0] >= 0xf0 || n == 0 || r[1] < r[0] ) {
+        r[0] = 0;
+        r[1] = 0xff;
+    }
+}
+
+// 1 if frame f, peeked from the head of the queue, has to wait for 
+// copies of an older frame for the same FreeMs to go out, so mustn't be
+// taken off the queue yet
+static uint8_t ir_frame_pending( uint8_t* f )
+{
+    uint8_t r[2];
+    ir_frame_for( f, r, ir_packed_q & 1 );
+    return IRsend_pendingFor( r[0], r[1] );
+}
+
+// called infinitely in main() along with handle_i2c()
+// moves queued frames into the transmitter's free slots, so the next
+// frame is ready to go while the current one is still on the air.
+// When aggregating, the next slot isn't filled until the frame on the
+// air is done, so as many commands as possible pile up to go with it.
+// Not when streaming though, the next frame has to be ready by then.
+// With repeats, a frame waits in the queue for the copies of older ones
+// for the same FreeMs to go out first, so they can't overtake it.  Frames
+// joined on to it wait too, see ir_image().  Nothing here waits itself.
+static void handle_ir_queue(void)
+{
+    uint8_t* slot;
+    uint64_t d;
+    uint8_t* f = (uint8_t*)(void*)&d;
+    uint8_t len;
+    uint8_t r[2];
+    uint8_t packed;
+    while( !RB_IsEmpty() && (slot = IRsend_getSlot()) != 0 ) {
+        if( (ir_frame_flags & FRAME_AGGREGATE) && IRsend_inFrame() &&
+            !ir_stream ) 
+            break;
+        d = RB_Peek();
+        if( ir_frame_pending( f ) ) 
+            break;
+        packed = ir_packed_q & 1;
+        if( packed ) {
+            ir_unqueue();
+            len = ir_image_packed( slot, f );
+        } else if( (ir_frame_flags & FRAME_IMAGE) && ir_frame_is_spot(f) ) {
+            ir_unqueue();
+            len = ir_image( slot, f );
+        } else if( (ir_frame_flags & FRAME_CONTEXT) && ir_frame_is_cmd(f) &&
+                   !ir_context_ok(f) ) {
+            // a copy of a command-only frame going out after the new 
+            // context would go to the wrong place, so no copies left first
+            if( IRsend_pendingFor( 0, 0xff ) ) 
+                break;
+            len = ir_context( slot, f );  // command goes out after it
+        } else {
+            ir_unqueue();
+            if( (ir_frame_flags & FRAME_AGGREGATE) && ir_frame_is_cmd(f) ) {
+                len = ir_aggregate( slot, f );
+            } else {
+                memcpy( slot, f, IR_FRAME_LEN );
+                len = ir_frame_len( slot );
+            }
+            if( (ir_frame_flags & FRAME_CONTEXT) && ir_frame_is_cmd(slot) )
+                len = ir_cmd_only( slot );
+        }
+        ir_frame_for( slot, r, packed );  // may take in more than f did
+        if( (ir_frame_flags & FRAME_SEQ) && !(slot[0] & FRAME_SEQ_BIT) ) 
+            len = ir_add_seq( slot, len );
+        if( (ir_frame_flags & FRAME_FEC) && !(slot[0] & FRAME_FEC_BIT) ) 
+            len = ir_fec( slot, len );
+        IRsend_sendSlotFor( len, r[0], r[1] );
+    }
+}
+
+// save the IR mode & any timing changes made with '&' to EEPROM
+static void ir_timing_save(void)
+{
+    eeprom_write_byte( &ee_ir_mode, ir_mode );
+    for( uint8_t i=0; i<IR_TM_COUNT; i++ ) 
+        eeprom_write_word( &ee_ir_timing[i], IRsend_getTiming(i) );
+}
+
+// at boot, use the IR mode & timing in EEPROM, if there is any
+static void ir_timing_load(void)
+{
+    uint8_t mode = eeprom_read_byte( &ee_ir_mode );
+    if( mode >= IR_MODE_COUNT ) 
+        return;
+    IRsend_setMode( mode );
+    for( uint8_t i=0; i<IR_TM_COUNT; i++ ) 
+        IRsend_setTiming( i, eeprom_read_word( &ee_ir_timing[i] ) );
+}
+
+// wait until all queued frames have gone out and the transmitter is idle
+static void ir_flush(void)
+{
+    ir_image_end();
+    while( !RB_IsEmpty() || IRsend_isBusy() ) 
+        handle_ir_queue();
+}
     
 // ----------------------------------------------------
 
-// read the specified number of values off i2c bus and into cmdargs array
-static void read_i2c_vals(uint8_t num)
+// Queues color r,g,b in rgb as colorspot pos of FreeM addr, for '='.
+// As a set colorspot frame, or with a packed ir_img_enc, in packed image
+// entries, 4 bytes of colors each, see FRAME_IMAGE at top.  The entry 
+// being filled is queued when it's full, when the next color doesn't 
+// carry on from it, or after the last color of a run.
+static void ir_image_color(uint8_t pos, uint8_t addr, uint8_t* rgb, 
+                           uint8_t last)
 {
-    for( uint8_t i=0; i<num; i++)
-        cmdargs[i] = usiTwiReceiveByte();
+    uint8_t enc = (ir_frame_flags & FRAME_IMAGE) ? ir_img_enc : IMG_ENC_RGB;
+    uint8_t* e = ir_img_entry;
+    uint8_t buf[IR_FRAME_LEN];
+    if( enc == IMG_ENC_RGB ) {
+        buf[0] = 0x55;           // magic start byte
+        buf[1] = addr;
+        buf[2] = 0xfe;           // 0xfe == set colorspot 
+        buf[3] = pos;
+        memcpy( buf+4, rgb, 3 );
+        buf[7] = compute_checksum(buf,7);
+        ir_queue( buf );
+        return;
+    }
+    if( e[3] && (e[0] != (FRAME_ENC_START | enc) || e[2] != pos || 
+                 addr != e[1] + e[3]) ) {
+        ir_queue_packed( e );
+        e[3] = 0;
+    }
+    if( e[3] == 0 ) {
+        memset( e, 0, IR_FRAME_LEN );
+        e[0] = FRAME_ENC_START | enc;
+        e[1] = addr;
+        e[2] = pos;
+    }
+    ir_img_put( e + 4, e[3]++, enc, rgb );
+    if( e[3] == FRAME_ENC_ENTRY(enc) || last ) {
+        ir_queue_packed( e );
+        e[3] = 0;
+    }
+}
+
+// Queues what's in the packed image entry '=' is filling, if anything.
+// For when a run of colors ends before its last one came in, so the 
+// colors aren't held back behind commands queued after them, or joined
+// on to by an unrelated run later.
+static void ir_image_end(void)
+{
+    if( ir_img_entry[3] ) {
+        ir_queue_packed( ir_img_entry );
+        ir_img_entry[3] = 0;
+    }
 }
 
 static void handle_script_cmd(void)
@@ -273,6 +1031,7 @@ static void handle_script_cmd(void)
         ir_dutyval = (val*100)/cmdargs[2];  
         break;
     case('%'):    // turn IR LED on or off, at pwm freq
+        ir_flush();   // don't stomp on a frame on the air
         if( cmdargs[0] != 0 ) {
             IRsend_enableIROut();
             IRsend_iron();
@@ -280,13 +1039,48 @@ static void handle_script_cmd(void)
             IRsend_iroff();
         }
         break;
-//  case('&'):     // adjust packet_millis
-//      packet_millis = cmdargs[0];
-//      wait_after    = cmdargs[1];
-//      break;
+    case('~'):     // set CtrlM option {'~', option, value, how}
+        ir_flush();                   // options apply to the next frame
+        if( cmdargs[0] == OPT_IR_MODE ) 
+            IRsend_setMode( cmdargs[1] );
+        else if( cmdargs[0] == OPT_FRAME_FLAGS ) { 
+            if( cmdargs[2] == OPT_BITS_ON ) 
+                ir_frame_flags |= cmdargs[1];
+            else
+                ir_frame_flags = cmdargs[1];
+            ir_ctx_left = 0;          // start over with a context frame
+        }
+        else if( cmdargs[0] == OPT_REPEATS ) 
+            IRsend_setRepeats( cmdargs[1] );
+        else if( cmdargs[0] == OPT_STREAM ) 
+            IRsend_setStream( cmdargs[1] );
+        else if( cmdargs[0] == OPT_IMAGE_ENC ) 
+            ir_img_enc = cmdargs[1];
+        else if( cmdargs[0] == OPT_SAVE ) { 
+            ir_saved_flags = ir_frame_flags;
+            ir_saved_enc   = ir_img_enc;
+        }
+        else if( cmdargs[0] == OPT_RESTORE ) { 
+            ir_frame_flags = ir_saved_flags;
+            ir_img_enc     = ir_saved_enc;
+            ir_ctx_left = 0;
+        }
+        break;
+    case('&'):     // set frame timing {'&', field, t_msb, t_lsb}
+        ir_flush();                   // the ISR is using it
+        if( cmdargs[0] == TIMING_SAVE ) {
+            ir_timing_save();
+        } else if( cmdargs[0] == TIMING_DEFAULTS ) {
+            eeprom_write_byte( &ee_ir_mode, 0xff );
+            IRsend_setMode( ir_mode );
+        } else { 
+            IRsend_setTiming( cmdargs[0], (cmdargs[1]<<8) | cmdargs[2] );
+        }
+        break;
     case('$'):     // send sony IR code
         val = cmdargs[0] << 8 | cmdargs[1];
-        IRsend_sendSony( val, 12);
+        ir_flush();   // sendCode() is not interrupt-driven
+        IRsend_sendCode( IR_PROTO_SONY, val );
         break;
 
         //
@@ -369,10 +1163,54 @@ static void handle_script_cmd(void)
         
         cmdargs[7] = compute_checksum(cmdargs,7);
             
-        IRsend_sendSonyData64bit( cmdargs );
+        ir_queue( cmdargs );
             
         break;
 
+    case('+'):  // set groups of FreeM freem_addr {'+', g_msb, g_lsb, 0}
+        cmdargs[4] = cmdargs[1]; // g_lsb
+        cmdargs[3] = cmdargs[0]; // g_msb
+        cmdargs[5] = cmdargs[6] = 0;
+
+        cmdargs[2] = 0xfc;       // 0xfc == set groups
+        cmdargs[1] = freem_addr;
+        cmdargs[0] = 0x55;       // magic start byte
+
+        cmdargs[7] = compute_checksum(cmdargs,7);
+
+        ir_queue( cmdargs );
+        break;
+
+    case(':'):  // set palette color {':', idx, r,g,b}
+        memcpy( ir_palette[cmdargs[0] & 0x0f], cmdargs+1, 3 );
+        cmdargs[6] = cmdargs[3]; // b
+        cmdargs[5] = cmdargs[2]; // g
+        cmdargs[4] = cmdargs[1]; // r
+        cmdargs[3] = cmdargs[0] & 0x0f; // idx
+
+        cmdargs[2] = 0xfb;       // 0xfb == set palette
+        cmdargs[1] = freem_addr;
+        cmdargs[0] = 0x55;       // magic start byte
+
+        cmdargs[7] = compute_checksum(cmdargs,7);
+
+        ir_queue( cmdargs );
+        break;
+
+    case('>'):  // copy colorspot {'>', src_pos, dst_pos, 0}
+        cmdargs[4] = cmdargs[1]; // dst_pos
+        cmdargs[3] = cmdargs[0]; // src_pos
+        cmdargs[5] = cmdargs[6] = 0;
+
+        cmdargs[2] = 0xfa;       // 0xfa == copy colorspot
+        cmdargs[1] = freem_addr;
+        cmdargs[0] = 0x55;       // magic start byte
+
+        cmdargs[7] = compute_checksum(cmdargs,7);
+
+        ir_queue( cmdargs );
+        break;
+
     default: // all other cases, treat as sending blinkm cmd (FIXME?)
         cmdargs[6] = cmdargs[2]; // arg3
         cmdargs[5] = cmdargs[1]; // arg2
@@ -385,8 +1223,13 @@ static void handle_script_cmd(void)
 
         cmdargs[7] = compute_checksum(cmdargs,7);
 
-        //IRsend_sendSonyData64bit( cmdargs, packet_millis, wait_after );
-        IRsend_sendSonyData64bit( cmdargs );
+        tmp = cmd_arity(cmd);
+        if( (ir_frame_flags & FRAME_SHORT) && tmp < 3 ) { // drop unused args
+            cmdargs[0] = FRAME_SHORT_START | tmp;
+            cmdargs[4+tmp] = compute_checksum(cmdargs,4+tmp);
+        }
+
+        ir_queue( cmdargs );
         break;
 
     } // switch(cmd)
@@ -398,40 +1241,82 @@ static void handle_script_cmd(void)
 
 }
 
+//
+// send n bytes back to the i2c master, for it to read.  Never waits: if
+// the master left too much of the last reply unread for all of this one
+// to fit, this one is dropped, and counted in i2c_dropped.  Returns 1 if
+// it was sent.
+//
+static uint8_t i2c_reply( uint8_t* buf, uint8_t n )
+{
+    if( usiTwiTransmitRoom() < n ) {
+        if( i2c_dropped != 0xff ) 
+            i2c_dropped++;
+        return 0;
+    }
+    for( uint8_t i=0; i<n; i++ ) 
+        usiTwiTryTransmitByte( buf[i] );
+    return 1;
+}
+
+//
+// how many i2c addrs to answer, from EEPROM, see 'M'
+//
+static uint8_t i2c_vaddr_count(void)
+{
+    uint8_t n = eeprom_read_byte( &ee_vaddr_count );
+    return ( n == 0 || n > I2C_VADDRS ) ? 1 : n;
+}
+
 //
 // called infinitely in main() along with handle_script()
 //
 static void handle_i2c(void)
 {
-    //uint8_t tmp;
-    if( usiTwiDataInReceiveBuffer() ) {
-        cmd  = usiTwiReceiveByte();
+    uint8_t reply[7];
+    uint16_t val;
+    uint8_t tmp;
+    uint8_t vaddr;
+    uint8_t freem_save, blinkm_save;
+    if( usiTwiTryGetCmd( &cmd, cmdargs, &vaddr ) ) { // whole command & all
+        freem_save  = freem_addr;
+        blinkm_save = blinkm_addr;
+        if( vaddr ) {  // came in on one of the other i2c addrs
+            freem_addr  = eeprom_read_byte( &ee_vaddr_map[vaddr][0] );
+            blinkm_addr = eeprom_read_byte( &ee_vaddr_map[vaddr][1] );
+        }
+        if( cmd != '=' && cmd != '{' ) 
+            ir_image_end();   // colors of a run cut short go out first
         switch(cmd) {
         case('@'):         // set addr to send to {'@',i2caddr,freemaddr}
         case('#'):         // script cmd: set ir pwm frequency & duty cycle
         case('%'):         // IR light on/off
-        case('&'):         // packet_wait_millis, wait_after
-            read_i2c_vals(3);  // all these take 3 args
+        case('~'):         // set CtrlM option
+        case('+'):         // set FreeM groups
+        case('>'):         // copy colorspot
             handle_script_cmd();
             break;
-        case('$'):         // script cmd: send ir code
-            read_i2c_vals(5);
-            if( cmdargs[0] == 0 ) { // FIXME: 0 == sony command type 
-                //uint32_t data = *(cmdargs+1);
-                IRsend_sendSony( (cmdargs[1]<<8) | cmdargs[2],12 );  // FIXME
-            } 
-            else if( cmdargs[0] == 1 ) {  // 1 == RC5
-                IRsend_sendSony( (cmdargs[1]<<8) | cmdargs[2],12 );  // FIXME
+        case('&'):         // set or read back frame timing
+            if( cmdargs[0] & TIMING_READ ) { 
+                val = IRsend_getTiming( cmdargs[0] & ~TIMING_READ );
+                reply[0] = val >> 8;
+                reply[1] = val & 0xff;
+                i2c_reply( reply, 2 );
+            } else {
+                handle_script_cmd();
             }
             break;
+        case('$'):         // script cmd: send ir code
+            ir_flush();   // sendCode() is not interrupt-driven
+            IRsend_sendCode( cmdargs[0], ((uint32_t)cmdargs[1]<<24) | 
+                             ((uint32_t)cmdargs[2]<<16) | 
+                             ((uint32_t)cmdargs[3]<<8) | cmdargs[4] );
+            break;
         case('!'):           // send arbitrary i2c data 
-            read_i2c_vals(8);  
-            IRsend_sendSonyData64bit( cmdargs );
+            ir_queue( cmdargs );
             //fanfare(3, 100 );
             break;
         case('^'):           // set colorspot {'^', 13, r,g,b }
-            read_i2c_vals(4);
-
             cmdargs[6] = cmdargs[3]; // b
             cmdargs[5] = cmdargs[2]; // g
             cmdargs[4] = cmdargs[1]; // r
@@ -443,11 +1328,34 @@ static void handle_i2c(void)
 
             cmdargs[7] = compute_checksum(cmdargs,7);
 
-            IRsend_sendSonyData64bit( cmdargs );
+            ir_queue( cmdargs );
 
+            break;
+        case('='):           // set colorspots {'=', 13, base, n, r,g,b,...}
+            // comes one color at a time, {pos, base, n, i, r,g,b}
+            if( cmdargs[3] == 0 )   // new run, the last one's over
+                ir_image_end();
+            ir_image_color( cmdargs[0], cmdargs[1] + cmdargs[3], cmdargs+4,
+                            cmdargs[3] == cmdargs[2] - 1 );
+            break;
+        case(':'):           // set palette color {':', 3, r,g,b }
+            handle_script_cmd();
+            break;
+        case('{'):           // bulk write {'{', type, id, base, n, items...}
+            // comes one item at a time, {type, id, base, n, i, item}
+            tmp = ( cmdargs[4] == cmdargs[3] - 1 );  // last one
+            if( cmdargs[0] == BULK_COLORSPOTS ) {
+                if( cmdargs[4] == 0 ) 
+                    ir_image_end();
+                ir_image_color( cmdargs[1], cmdargs[2] + cmdargs[4], 
+                                cmdargs+5, tmp );
+            }
+            else if( cmdargs[0] == BULK_SCRIPT && cmdargs[1] == 0 ) {
+                script_write_line_ee( cmdargs[2] + cmdargs[4], cmdargs+5, 
+                                      tmp );
+            }
             break;
         case('*'):           // play colorspot {'*', 13, 0, 0 }
-            read_i2c_vals(3);
             handle_script_cmd();
             /*
             tmp = blinkm_addr;  // FIXME: bit of a hack here
@@ -461,26 +1369,45 @@ static void handle_i2c(void)
             */
             break;
 
+        case('M'):         // set where an i2c addr goes {'M',vaddr,freem,blinkm}
+            if( cmdargs[0] == 0 ) {  // {'M',0,count,0}, addrs to answer
+                eeprom_write_byte( &ee_vaddr_count, cmdargs[1] );
+                usiTwiSlaveInit( eeprom_read_byte(&ee_i2c_addr), 
+                                 i2c_vaddr_count() );
+                _delay_ms(5);  // wait a bit so the USI can reset
+            }
+            else if( cmdargs[0] < I2C_VADDRS ) { 
+                eeprom_write_byte( &ee_vaddr_map[cmdargs[0]][0], cmdargs[1] );
+                eeprom_write_byte( &ee_vaddr_map[cmdargs[0]][1], cmdargs[2] );
+            }
+            break;
+        case('?'):         // get IR backlog & last command's airtime
+            ir_put_usecs( reply, ir_backlog() );
+            ir_put_usecs( reply+3, ir_last_airtime );
+            reply[6] = i2c_dropped;
+            if( i2c_reply( reply, 7 ) ) 
+                i2c_dropped = 0;
+            break;
+
             // stolen from blinkm.c
         case('a'):         // get address 
-            usiTwiTransmitByte( eeprom_read_byte(&ee_i2c_addr) );
+            reply[0] = eeprom_read_byte(&ee_i2c_addr);
+            i2c_reply( reply, 1 );
             break;
-        case('A'):         // set address
-            cmdargs[0] = cmdargs[1] = cmdargs[2] = cmdargs[3] = 0;
-            read_i2c_vals(4);  // address, 0xD0, 0x0D, address
+        case('A'):         // set address {'A', addr, 0xD0, 0x0D, addr}
             if( cmdargs[0] != 0 && cmdargs[0] == cmdargs[3] && 
                 cmdargs[1] == 0xD0 && cmdargs[2] == 0x0D ) {  // 
                 eeprom_write_byte( &ee_i2c_addr, cmdargs[0] ); // write address
-                usiTwiSlaveInit( cmdargs[0] );                 // re-init
+                usiTwiSlaveInit( cmdargs[0], i2c_vaddr_count() ); // re-init
                 _delay_ms(5);  // wait a bit so the USI can reset
             }
             break;
         case('Z'):        // return protocol version
-            usiTwiTransmitByte( BLINKM_PROTOCOL_VERSION_MAJOR );
-            usiTwiTransmitByte( BLINKM_PROTOCOL_VERSION_MINOR );
+            reply[0] = BLINKM_PROTOCOL_VERSION_MAJOR;
+            reply[1] = BLINKM_PROTOCOL_VERSION_MINOR;
+            i2c_reply( reply, 2 );
             break;
         case('P'):       // play ctrlm script
-            read_i2c_vals(3);
             play_script(0, cmdargs[1], cmdargs[2]);
             break;
 
@@ -491,12 +1418,10 @@ static void handle_i2c(void)
         case('h'):         // script cmd: fade to hsv color
         case('H'):         // script cmd: fade to random hsv color
         case('p'):         // script cmd: play script
-            read_i2c_vals(3);
             handle_script_cmd();
             break;
         case('f'):
         case('t'):
-            read_i2c_vals(1);
             handle_script_cmd();
         case('o'):
         case('O'):
@@ -506,10 +1431,10 @@ static void handle_i2c(void)
 // new v2 commands
 //
         case('l'):         // return script len & reps
-            read_i2c_vals(1);  // script_id
             if( cmdargs[0] == 0 ) { // eeprom script
-                usiTwiTransmitByte( eeprom_read_byte( &ee_script.len ) );
-                usiTwiTransmitByte( eeprom_read_byte( &ee_script.reps ) );
+                reply[0] = eeprom_read_byte( &ee_script.len );
+                reply[1] = eeprom_read_byte( &ee_script.reps );
+                i2c_reply( reply, 2 );
             }
             else {
                //script* s=(script*)pgm_read_word(&(fl_scripts[cmdargs[1]-1]));
@@ -517,17 +1442,30 @@ static void handle_i2c(void)
                //curr_script_reps = pgm_read_byte( (&s->reps) );
             }
         case('i'):         // return current input values
-            usiTwiTransmitByte( inputs[0] );
-            usiTwiTransmitByte( inputs[1] );
-            usiTwiTransmitByte( inputs[2] );
-            usiTwiTransmitByte( inputs[3] );
+            i2c_reply( inputs, 4 );
             break;
         
         } // switch(cmd)
+
+        if( vaddr ) {  // back to what '@' set
+            freem_addr  = freem_save;
+            blinkm_addr = blinkm_save;
+        }
         
     } // if(usiTwi)
 }
 
+// write buf {dur,cmd,a1,a2,a3} as line pos of the eeprom script, for '{'
+// the script ends after the last line of a write
+static void script_write_line_ee(uint16_t pos, uint8_t* buf, uint8_t last)
+{
+    if( pos >= EE_SCRIPT_LEN )     // past the end of EEPROM
+        return;
+    eeprom_write_block( buf, &ee_script.lines[pos], sizeof(script_line) );
+    if( last ) 
+        eeprom_write_byte( &ee_script.len, pos+1 );
+}
+
 // go to the next line in the script
 // called by scirpt_do_next_line() for eeprom-based scripts
 static void script_get_next_line_ee(void)
@@ -665,7 +1603,8 @@ int main( void )
       defined(__AVR_ATtiny85__)
 
     // set up periodic timer for state machine ('script_tick')
-    TCCR0B = _BV( CS02 ) | _BV(CS00); // start timer, prescale CLK/1024
+    // and IR transmitter (compare A, turned on by IRsend.h when sending)
+    TCCR0B = IR_TIMER0_CS;         // start timer, ~1usec ticks, see IRsend.h
     TIFR   = _BV( TOV0 );          // clear interrupt flag
     TIMSK  = _BV( TOIE0 );         // enable overflow interrupt
 
@@ -680,6 +1619,7 @@ int main( void )
     //TCCR0B = _BV( CS02 ) | _BV(CS00); // start timer, prescale CLK/1024
     //TIFR0  = _BV( TOV0 );          // clear interrupt flag
     //TIMSK0 = _BV( TOIE0 );         // enable overflow interrupt
+    TCCR0B = IR_TIMER0_CS;         // IR transmitter timer, see IRsend.h
     // set up output pins   
     PORTA = INPI2C_MASK;          // turn on pullups 
     DDRA  = 0xFF; //LEDA_MASK;            // set LED port pins to output
@@ -737,7 +1677,11 @@ int main( void )
     uint8_t i2c_addr = eeprom_read_byte( &ee_i2c_addr );
     if( i2c_addr==0 || i2c_addr>0x7f) i2c_addr = I2C_ADDR;  // just in case
 
-    usiTwiSlaveInit( i2c_addr );
+    usiTwiSlaveInit( i2c_addr, i2c_vaddr_count() );
+
+    RB_Init();                  // IR send queue
+    IRsend_setMode( IR_MODE_SONY );
+    ir_timing_load();           // unless another was saved with '&'
 
     timeadj    = boot_timeadj;
     if( boot_mode == BOOT_PLAY_SCRIPT ) {
@@ -757,6 +1701,7 @@ int main( void )
         handle_i2c();
         handle_inputs();
         handle_script();
+        handle_ir_queue();
     }
     
 } // end
@@ -765,10 +1710,15 @@ int main( void )
 //
 // State machine pulse
 // updates "script_tick" every 1/30th of a second (
+// timer0 is sped up for the IR transmitter, so overflows SCRIPT_TICK_DIV
+// times as often as it did at CLK/1024; count those down first
 //
 ISR(SIG_OVERFLOW0)
 {
-    script_tick++;
+    if( ++script_tick_div == SCRIPT_TICK_DIV ) {
+        script_tick_div = 0;
+        script_tick++;
+    }
 }
 
 
@@ -780,23 +1730,6 @@ ISR(SIG_OVERFLOW0)
 // ------------------------------------------------------------------------
 
 
-// stolen from http://graphics.stanford.edu/~seander/bithacks.html
-// v == value to reverse, s == number of bits in value
-// doesn't mask out upper, nonsensicle values
-uint8_t reverse8(uint8_t v)
-{
-  uint8_t r =v;
-  //int s = sizeof(v) * CHAR_BIT - 1; // extra shift needed at end
-  uint8_t s = 8;
-  for (v >>= 1; v; v >>= 1) {   
-    r <<= 1;  
-    r |= v & 1;
-    s--;
-  }  
-  r <<= s; // shift when v's highest bits are zero
-  return r;
-}
-
 //
 static void basic_tests(void)
 {
@@ -820,10 +1753,10 @@ static void basic_tests(void)
 #if 0 
     // test basic IR sending capability
     while( 1 ) { 
-        IRsend_sendSony( 0x610, 12); // 7 key
-        //IRsend_sendSony( 0x910, 12); // 0 key
+        IRsend_sendCode( IR_PROTO_SONY, 0x610 ); // 7 key
+        //IRsend_sendCode( IR_PROTO_SONY, 0x910 ); // 0 key
         _delay_ms(1500);
-        IRsend_sendSony( 0xa90, 12); // power key 
+        IRsend_sendCode( IR_PROTO_SONY, 0xa90 ); // power key 
         _delay_ms(1500);
     }
 #endif
@@ -832,7 +1765,7 @@ static void basic_tests(void)
     // test basic IR sending capability
     int c = 0;
     while( 1 ) { 
-        IRsend_sendSony( c, 16);
+        IRsend_sendCode( IR_PROTO_NEC, c );
         _delay_ms(50);
         c--;
     }
@@ -842,9 +1775,9 @@ static void basic_tests(void)
 #if 0 
     // test basic IR sending capability
     while( 1 ) { 
-        IRsend_sendRC5( TOPBIT + 0x1234, 32); // 
+        IRsend_sendCode( IR_PROTO_RC5, 0x1234 ); // 
         _delay_ms(1500);
-        IRsend_sendRC5( TOPBIT + 0xABCD, 32); // 
+        IRsend_sendCode( IR_PROTO_RC5, 0xABCD ); // 
         _delay_ms(1500);
     }
 #endif
@@ -853,42 +1786,12 @@ static void basic_tests(void)
     // test basic IR sending capability
     int c = 0;
     while( 1 ) { 
-        IRsend_sendRC6( c, 32); // 
+        IRsend_sendCode( IR_PROTO_RC6, c ); // 
         _delay_ms(50);
         c--;
     }
 #endif
 
-#if 0 
-    // test basic IR sending capability
-    int c = 0;
-    while( 1 ) { 
-        IRsend_txByte( reverse8(c) ); // 
-        _delay_ms(50);
-        c++;
-    }
-#endif
-
-#if 0 
-    // test basic IR sending capability
-    int c = 0;
-    while( 1 ) { 
-        IRsend_sendSonyData4( c ); // 
-        c += 0x100;    //c--;
-        //_delay_ms(50); // 50msec needed when using IRrecvDump
-        _delay_ms(5);   // 3msec GAP in ctrlm source
-        IRsend_sendSonyData4( c ); // 
-        c++;          //c--;
-        /*
-        _delay_ms(5);
-        IRsend_sendSonyData4( c-- ); // 
-        _delay_ms(5);
-        IRsend_sendSonyData4( c-- ); // 
-        */
-        _delay_ms(100);
-    }
-#endif
-
 #if 1 
     // test basic IR sending capability
     uint8_t b[8] = {0x01, 0x23, 0x45, 0x67,  0x89, 0xAB, 0xCD, 0xEF};
@@ -11,6 +11,10 @@
 #define I2C_ADDR 0x09
 #endif
 
+// most i2c addresses answered, I2C_ADDR & up, each can go to its own 
+// FreeM.  How many is set in ee_vaddr_count, just I2C_ADDR by default.
+#define I2C_VADDRS 8
+
 // number of of script ticks per 'w'ait command
 //  30.52 script ticks == 1 second
 //  153   script ticks == 5.013 seconds
@@ -37,6 +41,27 @@ typedef struct _script {
     script_line lines[];
 } script;
 
+// number of ir_timing fields (IR_TM_* in IRsend.h), saved in ee_ir_timing
+#define IR_TM_COUNT 10
+
+// EEPROM that isn't script: the bytes before it, len & reps, and the 
+// CtrlM settings after it (ee_ir_mode on)
+#define EE_NOT_SCRIPT (7 + 2 + 1 + 2*IR_TM_COUNT + 2*I2C_VADDRS + 1)
+
+// lines the eeprom script has room for, fewer on chips with less EEPROM
+#if (E2END + 1 - EE_NOT_SCRIPT) / 5 < MAX_EE_SCRIPT_LEN
+#define EE_SCRIPT_LEN ((E2END + 1 - EE_NOT_SCRIPT) / 5)
+#else
+#define EE_SCRIPT_LEN MAX_EE_SCRIPT_LEN
+#endif
+
+// the eeprom script, sized so what comes after it stays put
+typedef struct _script_ee {
+    uint8_t len;
+    uint8_t reps;
+    script_line lines[EE_SCRIPT_LEN];
+} script_ee;
+
 
 // eeprom begin: muncha buncha eeprom
 uint8_t  ee_i2c_addr         EEMEM = I2C_ADDR;
@@ -65,7 +90,7 @@ script ee_script  EEMEM = {
 */
 
 
-script ee_script  EEMEM = {
+script_ee ee_script  EEMEM = {
     6, // number of seq_lines
     0, // number of repeats, also acts as boot repeats?
     {  // dur, cmd,  arg1,arg2,arg3
@@ -107,4 +132,12 @@ script ee_script  EEMEM = {
 };
 */
 
+// after the script, so a flash-only upgrade finds the script where it was
+uint8_t  ee_ir_mode          EEMEM = 0xff;  // 0xff == no saved timing
+uint16_t ee_ir_timing[IR_TM_COUNT] EEMEM;         // IR_TM_* fields, see '&'
+uint8_t  ee_vaddr_map[I2C_VADDRS][2] EEMEM = { // {freem,blinkm}, see 'M'
+    {0,0}, {1,0}, {2,0}, {3,0}, {4,0}, {5,0}, {6,0}, {7,0}
+};
+uint8_t  ee_vaddr_count      EEMEM = 1;     // i2c addrs answered, see 'M'
+
 // eeprom end
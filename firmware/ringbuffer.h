@@ -0,0 +1,27 @@
+// AT90USB/ringbuffer.h
+// Simple Ring-Buffer (FIFO) for Elements of type Q
+// S. Salewski, 20-MAR-2007
+
+#ifndef _RING_BUFFER_H_
+#define _RING_BUFFER_H_
+
+#include <stdint.h>
+
+//#define BufElements 1024
+//#define Q uint16_t
+#define BufElements 8
+#define Q uint64_t
+
+extern uint16_t RB_Entries;
+
+#define RB_FreeSpace() (BufElements - RB_Entries)
+#define RB_IsFull() (RB_Entries == BufElements)
+#define RB_IsEmpty() (RB_Entries == 0)
+
+void RB_Init(void);
+void RB_Write(Q el);
+Q RB_Read(void);
+Q RB_Peek(void);
+Q RB_PeekAt(uint16_t i);
+
+#endif
@@ -42,6 +42,7 @@ Change Activity:
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <string.h>
 #include "usiTwiSlave.h"
 
 
@@ -263,12 +264,25 @@ typedef enum
 ********************************************************************************/
 
 // moved slaveAddress to header -=tod
+static uint8_t                  slaveAddressCount; // answer slaveAddress & up
 static volatile overflowState_t overflowState;
 
 
-static uint8_t          rxBuf[ TWI_RX_BUFFER_SIZE ];
-static volatile uint8_t rxHead;
-static volatile uint8_t rxTail;
+// command queue, see usiTwiSlave.h
+static uint8_t          cmdQueue[ TWI_CMD_SLOTS ][ TWI_CMD_LEN ];
+static uint8_t          cmdAddr[ TWI_CMD_SLOTS ];  // address each came in on
+static volatile uint8_t cmdHead;        // slot the next whole command goes in
+static volatile uint8_t cmdTail;        // slot main loop takes next
+static volatile uint8_t cmdCount;       // whole commands in the queue
+
+// command being put together by the overflow ISR
+static uint8_t          cmdBuf[ TWI_CMD_LEN ];
+static uint8_t          cmdBufAddr;     // address it's coming in on
+static uint8_t          cmdPos;         // bytes of it so far, 0 == none
+static uint8_t          cmdLen;         // command byte & args
+static uint8_t          cmdUnit;        // bytes in a run item, 0 == no run
+static uint8_t          cmdItems;       // run items still to come
+static volatile uint8_t cmdHeld;        // 1 == SCL held low, queue full
 
 static uint8_t          txBuf[ TWI_TX_BUFFER_SIZE ];
 static volatile uint8_t txHead;
@@ -292,14 +306,102 @@ flushTwiBuffers(
   void
 )
 {
-  rxTail = 0;
-  rxHead = 0;
+  cmdHead = 0;
+  cmdTail = 0;
+  cmdCount = 0;
+  cmdPos = 0;
+  cmdHeld = 0;
   txTail = 0;
   txHead = 0;
 } // end flushTwiBuffers
 
 
 
+// put cmdBuf in the command queue, or drop it if the queue is full
+// (it can't be, the ISR holds the bus until there's room)
+
+static
+void
+queueCmd(
+  void
+)
+{
+  if ( cmdCount == TWI_CMD_SLOTS )
+  {
+    return;
+  }
+  memcpy( cmdQueue[ cmdHead ], cmdBuf, TWI_CMD_LEN );
+  cmdAddr[ cmdHead ] = cmdBufAddr;
+  cmdHead = ( cmdHead + 1 ) % TWI_CMD_SLOTS;
+  cmdCount++;
+} // end queueCmd
+
+
+
+// add a received byte to the command being put together, and queue it
+// when it's whole
+
+static
+void
+receiveCmdByte(
+  uint8_t data
+)
+{
+
+  uint8_t arity;
+
+  if ( cmdPos == 0 )
+  {
+    // command byte, look up what follows it
+    arity = usiTwiCmdArity( data );
+    cmdLen = 1 + ( arity & TWI_CMD_ARGS_MASK );
+    cmdUnit = arity >> 4;
+  }
+  if ( cmdPos < TWI_CMD_LEN )
+  {
+    cmdBuf[ cmdPos ] = data;
+  }
+  cmdPos++;
+
+  if ( cmdUnit == 0 )
+  {
+    // plain command, done after its args
+    if ( cmdPos == cmdLen )
+    {
+      queueCmd( );
+      cmdPos = 0;
+    }
+  }
+  else if ( cmdPos == cmdLen )
+  {
+    // run command, args done, the last says how many items
+    if ( cmdUnit == ( TWI_CMD_RUN_BY_ARGS >> 4 ) )
+    {
+      cmdUnit = usiTwiCmdRunUnit( cmdBuf );
+    }
+    cmdItems = data;
+    cmdBuf[ cmdPos++ ] = 0;
+    if ( cmdItems == 0 )
+    {
+      cmdPos = 0;
+    }
+  }
+  else if ( cmdPos == cmdLen + 1 + cmdUnit )
+  {
+    // run item done, the next one goes after the same args
+    queueCmd( );
+    cmdBuf[ cmdLen ]++;
+    cmdPos = cmdLen + 1;
+    if ( --cmdItems == 0 )
+    {
+      cmdPos = 0;
+    }
+  }
+
+} // end receiveCmdByte
+
+
+
 /********************************************************************************
 
                                 public functions
@@ -308,17 +410,20 @@ flushTwiBuffers(
 
 
 
-// initialise USI for TWI slave mode
+// initialise USI for TWI slave mode, answering numAddresses addresses
+// from ownAddress up
 
 void
 usiTwiSlaveInit(
-  uint8_t ownAddress
+  uint8_t ownAddress,
+  uint8_t numAddresses
 )
 {
 
   flushTwiBuffers( );
 
   slaveAddress = ownAddress;
+  slaveAddressCount = numAddresses;
 
   // In Two Wire mode (USIWM1, USIWM0 = 1X), the slave USI will pull SCL
   // low when a start condition is detected or a counter overflow (only
@@ -358,10 +463,11 @@ usiTwiSlaveInit(
 
 
 
-// put data in the transmission buffer, wait if buffer is full
+// put data in the transmission buffer if there's room, return false
+// (and don't wait) if it's full of bytes the master hasn't read
 
-void
-usiTwiTransmitByte(
+bool
+usiTwiTryTransmitByte(
   uint8_t data
 )
 {
@@ -371,8 +477,11 @@ usiTwiTransmitByte(
   // calculate buffer index
   tmphead = ( txHead + 1 ) & TWI_TX_BUFFER_MASK;
 
-  // wait for free space in buffer
-  while ( tmphead == txTail );
+  // no free space in buffer
+  if ( tmphead == txTail )
+  {
+    return false;
+  }
 
   // store data in buffer
   txBuf[ tmphead ] = data;
@@ -380,43 +489,87 @@ usiTwiTransmitByte(
   // store new index
   txHead = tmphead;
 
-} // end usiTwiTransmitByte
+  return true;
+
+} // end usiTwiTryTransmitByte
 
 
 
-// return a byte from the receive buffer, wait if buffer is empty
+// how many bytes usiTwiTryTransmitByte() can take right now, so a reply
+// can go in whole or not at all
 
 uint8_t
-usiTwiReceiveByte(
+usiTwiTransmitRoom(
   void
 )
 {
 
-  // wait for Rx data
-  while ( rxHead == rxTail );
+  // one slot is always left empty, to tell full from empty
+  return ( txTail - txHead - 1 ) & TWI_TX_BUFFER_MASK;
 
-  // calculate buffer index
-  rxTail = ( rxTail + 1 ) & TWI_RX_BUFFER_MASK;
+} // end usiTwiTransmitRoom
 
-  // return data from the buffer.
-  return rxBuf[ rxTail ];
 
-} // end usiTwiReceiveByte
 
+// throw away whatever the master hasn't read from the transmission buffer
 
+void
+usiTwiFlushTransmit(
+  void
+)
+{
+
+  // the ISR only moves txTail up to txHead, so this is safe
+  txTail = txHead;
 
-// check if there is data in the receive buffer
+} // end usiTwiFlushTransmit
+
+
+
+// take the oldest whole command off the queue if there is one: the
+// command byte goes in cmd, its args in args (TWI_CMD_LEN - 1 bytes),
+// the address it came in on in addr, as 0 for ownAddress, 1 for the next..
+// return false (and don't wait) if there's none
 
 bool
-usiTwiDataInReceiveBuffer(
-  void
+usiTwiTryGetCmd(
+  uint8_t * cmd,
+  uint8_t * args,
+  uint8_t * addr
 )
 {
 
-  // return 0 (false) if the receive buffer is empty
-  return rxHead != rxTail;
+  uint8_t sreg;
 
-} // end usiTwiDataInReceiveBuffer
+  if ( cmdCount == 0 )
+  {
+    return false;
+  }
+
+  *cmd = cmdQueue[ cmdTail ][ 0 ];
+  *addr = cmdAddr[ cmdTail ];
+  memcpy( args, cmdQueue[ cmdTail ] + 1, TWI_CMD_LEN - 1 );
+  cmdTail = ( cmdTail + 1 ) % TWI_CMD_SLOTS;
+
+  // free the slot, the ISR may fill it right away
+  sreg = SREG;
+  cli( );
+  cmdCount--;
+  if ( cmdHeld )
+  {
+    // the ISR held SCL low on a byte for want of room, take it now
+    // and let the master go on
+    cmdHeld = 0;
+    receiveCmdByte( USIDR );
+    overflowState = USI_SLAVE_REQUEST_DATA;
+    SET_USI_TO_SEND_ACK( );
+    USICR |= ( 1 << USIOIE );
+  }
+  SREG = sreg;
+
+  return true;
+
+} // end usiTwiTryGetCmd
 
 
 
@@ -432,6 +585,9 @@ ISR( USI_START_VECTOR )
   // set default starting conditions for new TWI package
   overflowState = USI_SLAVE_CHECK_ADDRESS;
 
+  // a command the last package cut short is dropped
+  cmdPos = 0;
+
   // set SDA as input
   DDR_USI &= ~( 1 << PORT_USI_SDA );
 
@@ -516,8 +672,20 @@ ISR( USI_OVERFLOW_VECTOR )
 
     // Address mode: check address and send ACK (and next USI_SLAVE_SEND_DATA) if OK,
     // else reset USI
+    // one compare for the whole range, the general call goes to the first
     case USI_SLAVE_CHECK_ADDRESS:
-      if ( ( USIDR == 0 ) || ( ( USIDR >> 1 ) == slaveAddress) )
+      cmdBufAddr = ( uint8_t )( ( USIDR >> 1 ) - slaveAddress );
+      if ( USIDR == 0 )
+      {
+        cmdBufAddr = 0;
+      }
+      // a read with no reply ready is NACKed, so the master can tell it
+      // from a reply and try again, instead of reading 0xff
+      if ( ( USIDR & 0x01 ) && ( txHead == txTail ) )
+      {
+        cmdBufAddr = 0xff;
+      }
+      if ( cmdBufAddr < slaveAddressCount )
       {
           if ( USIDR & 0x01 )
         {
@@ -583,10 +751,16 @@ ISR( USI_OVERFLOW_VECTOR )
     // copy data from USIDR and send ACK
     // next USI_SLAVE_REQUEST_DATA
     case USI_SLAVE_GET_DATA_AND_SEND_ACK:
-      // put data into buffer
-      // Not necessary, but prevents warnings
-      rxHead = ( rxHead + 1 ) & TWI_RX_BUFFER_MASK;
-      rxBuf[ rxHead ] = USIDR;
+      if ( cmdCount == TWI_CMD_SLOTS )
+      {
+        // no room for a command: leave USIOIF set, so SCL stays low
+        // and the master waits, until usiTwiTryGetCmd() frees a slot
+        USICR &= ~( 1 << USIOIE );
+        cmdHeld = 1;
+        return;
+      }
+      // put data into the command being received
+      receiveCmdByte( USIDR );
       // next USI_SLAVE_REQUEST_DATA
       overflowState = USI_SLAVE_REQUEST_DATA;
       SET_USI_TO_SEND_ACK( );
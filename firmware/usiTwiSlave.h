@@ -52,10 +52,20 @@ Change Activity:
 
 ********************************************************************************/
 
-void    usiTwiSlaveInit( uint8_t );
-void    usiTwiTransmitByte( uint8_t );
-uint8_t usiTwiReceiveByte( void );
-bool    usiTwiDataInReceiveBuffer( void );
+void    usiTwiSlaveInit( uint8_t, uint8_t );
+bool    usiTwiTryTransmitByte( uint8_t );
+uint8_t usiTwiTransmitRoom( void );
+void    usiTwiFlushTransmit( void );
+bool    usiTwiTryGetCmd( uint8_t *, uint8_t *, uint8_t * );
+
+// supplied by the application: how many arg bytes follow command byte cmd,
+// | TWI_CMD_RUN( unit ) if a run of unit-byte items follows the args too,
+// or | TWI_CMD_RUN_BY_ARGS if the unit depends on the args
+uint8_t usiTwiCmdArity( uint8_t cmd );
+
+// supplied by the application: for a TWI_CMD_RUN_BY_ARGS command, the
+// bytes in each item (1 or more), given the command byte & args in cmd
+uint8_t usiTwiCmdRunUnit( uint8_t * cmd );
 
 static uint8_t                  slaveAddress;  // moved from .c -=tod
 
@@ -66,18 +76,27 @@ static uint8_t                  slaveAddress;  // moved from .c -=tod
 
 ********************************************************************************/
 
-// permitted RX buffer sizes: 1, 2, 4, 8, 16, 32, 64, 128 or 256
+// Received bytes are put together into whole commands by the overflow ISR,
+// one per slot of the command queue: the command byte, then its args.
+// A command cut short by a new START is dropped.  When the queue is full,
+// SCL is held low (clock stretching) until usiTwiTryGetCmd() frees a slot,
+// so the master waits instead of bytes getting lost.  A run command's items
+// each get their own slot: the command byte & args, the item's index in
+// the run, then the item.  The last arg says how many items there are.
+// A run can be as long as the master likes to make it, the queue is
+// emptied as it comes in.
+// Each command also keeps which of the slave's addresses it came in on.
 
-#define TWI_RX_BUFFER_SIZE  ( 16 )
-#define TWI_RX_BUFFER_MASK  ( TWI_RX_BUFFER_SIZE - 1 )
+#define TWI_CMD_SLOTS  ( 4 )   // commands the queue holds
+#define TWI_CMD_LEN    ( 11 )  // bytes in a slot, command byte & up to 10 args
 
-#if ( TWI_RX_BUFFER_SIZE & TWI_RX_BUFFER_MASK )
-#  error TWI RX buffer size is not a power of 2
-#endif
+#define TWI_CMD_ARGS_MASK  ( 0x0f )
+#define TWI_CMD_RUN( unit ) ( ( unit ) << 4 )
+#define TWI_CMD_RUN_BY_ARGS TWI_CMD_RUN( 0x0f )
 
 // permitted TX buffer sizes: 1, 2, 4, 8, 16, 32, 64, 128 or 256
 
-#define TWI_TX_BUFFER_SIZE ( 4 )
+#define TWI_TX_BUFFER_SIZE ( 8 )
 #define TWI_TX_BUFFER_MASK ( TWI_TX_BUFFER_SIZE - 1 )
 
 #if ( TWI_TX_BUFFER_SIZE & TWI_TX_BUFFER_MASK )
@@ -14,6 +14,108 @@ IRrecv irrecv(RECV_PIN);
 
 decode_results results;
 
+// Acts like the FreeM at this address, to show which frames it would take
+#define FREEM_ADDR 1
+uint16_t freemGroups = 0;  // set with blinkm_addr 0xfc frames, bit g = group g
+uint8_t freemPalette[16][3]; // set with blinkm_addr 0xfb frames
+
+// Would our FreeM take a frame to freem_addr 'addr'?  0 is all FreeMs,
+// 0xf0-0xff are groups 0-15.
+boolean freemWants(uint8_t addr) {
+  if (addr == 0 || addr == FREEM_ADDR) {
+    return true;
+  }
+  return (addr & 0xf0) == 0xf0 && (freemGroups & (1 << (addr & 0x0f)));
+}
+
+// Prints if our FreeM would take the frame, and keeps its new groups if 
+// the frame sets them.  Context frames aren't for anyone, just say who's next.
+// Image frames are for FreeMs base_addr and up, one color each.
+// Palette colors for packed image frames come from 0xfb frames.
+void dumpFreeM(decode_results *results) {
+  uint8_t *data = results->data;
+  uint8_t type = data[0] & 0x70;
+  int o = (data[0] & 0x08) ? 2 : 1; // skip seq byte
+  int freem, blinkm, cmd = -1;
+  if (type == 0x40) {
+    return;
+  }
+  if (type == 0x20) { // image frame, the color at our offset from base
+    int i = FREEM_ADDR - data[o];
+    if (i < 0 || i >= (data[0] & 0x07)) {
+      Serial.print(", not for us");
+      return;
+    }
+    Serial.print(", for us: colorspot ");
+    Serial.print(data[o+1], DEC);
+    for (int j = 0; j < 3; j++) {
+      Serial.print(j ? "," : " ");
+      Serial.print(data[o+2+3*i+j], HEX);
+    }
+    return;
+  }
+  if (type == 0x10) { // packed image frame, same but smaller colors
+    int i = FREEM_ADDR - data[o];
+    uint8_t *c = data + o + 3;
+    uint8_t rgb[3];
+    if (i < 0 || i >= data[o+2]) {
+      Serial.print(", not for us");
+      return;
+    }
+    if ((data[0] & 0x07) == 1) { // RGB565
+      rgb[0] = c[2*i] & 0xf8;
+      rgb[1] = (c[2*i] << 5) | ((c[2*i+1] >> 3) & 0x1c);
+      rgb[2] = c[2*i+1] << 3;
+    }
+    else {                       // palette index
+      uint8_t idx = (i & 1) ? (c[i/2] & 0x0f) : (c[i/2] >> 4);
+      memcpy(rgb, freemPalette[idx], 3);
+      Serial.print(", palette ");
+      Serial.print(idx, DEC);
+    }
+    Serial.print(", for us: colorspot ");
+    Serial.print(data[o+1], DEC);
+    for (int j = 0; j < 3; j++) {
+      Serial.print(j ? "," : " ");
+      Serial.print(rgb[j], HEX);
+    }
+    return;
+  }
+  if (type == 0x30) {
+    if (irrecv.ctxFreem < 0) {
+      return;
+    }
+    freem = irrecv.ctxFreem;
+    blinkm = irrecv.ctxBlinkm;
+    cmd = o;
+  }
+  else {
+    freem = data[o];
+    blinkm = data[o+1];
+    cmd = o+2;
+  }
+  if (!freemWants(freem)) {
+    Serial.print(", not for us");
+    return;
+  }
+  Serial.print(", for us");
+  if (blinkm == 0xfc && type != 0x70) {
+    freemGroups = (data[cmd] << 8) | data[cmd+1];
+    Serial.print(", groups set ");
+    Serial.print(freemGroups, HEX);
+  }
+  if (blinkm == 0xfb && type != 0x70) {
+    memcpy(freemPalette[data[cmd] & 0x0f], data + cmd + 1, 3);
+    Serial.print(", palette set");
+  }
+  if (blinkm == 0xfa && type != 0x70) {
+    Serial.print(", colorspot ");
+    Serial.print(data[cmd], DEC);
+    Serial.print(" copied to ");
+    Serial.print(data[cmd+1], DEC);
+  }
+}
+
 void setup()
 {
   Serial.begin(115200);
@@ -21,6 +123,74 @@ void setup()
   irrecv.enableIRIn(); // Start the receiver
 }
 
+// Prints the bytes of a CtrlM frame, whether its checksum is good, 
+// and how long it took on the air (less the last space), to compare 
+// timing modes.  Frames of a stream after the first have no raw timing.
+void dumpCtrlM(decode_results *results) {
+  int nbytes = results->bits / 8;
+  uint8_t chksum = 0;
+  unsigned long usecs = 0;
+  if (results->decode_type == CTRLM_FAST) {
+    Serial.print("Decoded CTRLM fast: ");
+  }
+  else if (results->decode_type == CTRLM_PPM) {
+    Serial.print("Decoded CTRLM ppm: ");
+  }
+  else {
+    Serial.print("Decoded CTRLM: ");
+  }
+  for (int i = 0; i < nbytes; i++) {
+    Serial.print(results->data[i], HEX);
+    Serial.print(",");
+    if (i < nbytes - 1) {
+      chksum += results->data[i];
+    }
+  }
+  if (results->fec == CTRLM_FEC_FIXED) {
+    Serial.print(" crc ok, 1 bit fixed");
+  }
+  else if (results->fec == CTRLM_FEC_OK) {
+    Serial.print(" crc ok");
+  }
+  else {
+    Serial.print((chksum == results->data[nbytes-1]) ? 
+                 " chksum ok" : " chksum BAD");
+  }
+  for (int i = 1; i < results->rawlen; i++) {
+    usecs += results->rawbuf[i] * USECPERTICK;
+  }
+  if (results->seq >= 0) {
+    Serial.print(", seq ");
+    Serial.print(results->seq, DEC);
+    if (results->dup) {
+      Serial.print(" (copy, ignored)");
+    }
+  }
+  if ((results->data[0] & 0x70) == 0x30) { // command-only frame
+    if (irrecv.ctxFreem < 0) {
+      Serial.print(", no context yet");
+    }
+    else {
+      Serial.print(", to freem ");
+      Serial.print(irrecv.ctxFreem, HEX);
+      Serial.print(" blinkm ");
+      Serial.print(irrecv.ctxBlinkm, HEX);
+    }
+  }
+  if (!results->dup) {
+    dumpFreeM(results);
+  }
+  if (results->stream) {
+    Serial.print(", streamed");
+  }
+  if (results->rawlen > 0) {
+    Serial.print(", ");
+    Serial.print(usecs, DEC);
+    Serial.print(" usec");
+  }
+  Serial.println("");
+}
+
 // Dumps out the decode_results structure.
 // Call this after IRrecv::decode()
 // void * to work around compiler issue
@@ -31,6 +201,11 @@ void dump(decode_results *results) {
   if (results->decode_type == UNKNOWN) {
     Serial.println("Could not decode message");
   } 
+  else if (results->decode_type == CTRLM || 
+           results->decode_type == CTRLM_FAST ||
+           results->decode_type == CTRLM_PPM) {
+    dumpCtrlM(results);
+  }
   else {
     if (results->decode_type == NEC) {
       Serial.print("Decoded NEC: ");
@@ -49,6 +224,9 @@ void dump(decode_results *results) {
     Serial.print(results->bits, DEC);
     Serial.println(" bits)");
   }
+  if (count == 0) {
+    return;
+  }
   Serial.print("Raw (");
   Serial.print(count, DEC);
   Serial.print("): ");
@@ -216,6 +216,12 @@ IRrecv::IRrecv(int recvpin)
 {
   irparams.recvpin = recvpin;
   irparams.blinkflag = 0;
+  for (int i = 0; i < CTRLM_SEQ_HISTORY; i++) {
+    seqHistory[i] = -1;
+  }
+  seqNext = 0;
+  ctxFreem = -1;
+  ctxBlinkm = -1;
 }
 
 // initialization
@@ -240,7 +246,8 @@ void IRrecv::enableIRIn() {
   // initialize state machine variables
   irparams.rcvstate = STATE_IDLE;
   irparams.rawlen = 0;
-
+  irparams.rawsync = 0;
+  irparams.stream = 0;
 
   // set pin modes
   pinMode(irparams.recvpin, INPUT);
@@ -254,6 +261,106 @@ void IRrecv::blink13(int blinkflag)
     pinMode(BLINKLED, OUTPUT);
 }
 
+// CtrlM streams: after the first frame, each frame follows the one 
+// before with just a sync mark and a header space, no gap.  There's no 
+// time to hand rawbuf to decode() and wait for resume(), so at the first
+// sync mark the ISR locks on, and decodes the rest of the frames itself 
+// as they come, into two sdata frames that decode() takes in turn.
+// The gap at the end of the burst unlocks it.
+
+// Starts a streamed frame.  It's dropped if decode() hasn't taken the 
+// last one out of this sdata frame yet.
+static void streamFrame() {
+  irparams.scount = irparams.sbits[irparams.sfill] ? -1 : 0;
+  irparams.shdr = 1;
+}
+
+// Ends a streamed frame, for decode() to take
+static void streamEnd() {
+  if (irparams.scount > 0) {
+    irparams.sbits[irparams.sfill] = irparams.scount;
+    irparams.stype[irparams.sfill] = irparams.stream;
+    irparams.sfill ^= 1;
+  }
+}
+
+// Adds the low n bits of b to the streamed frame
+static void streamBits(uint8_t b, uint8_t n) {
+  int count = irparams.scount;
+  if (count < 0) {
+    return;
+  }
+  if (count + n > 8 * CTRLM_MAX_BYTES) {
+    irparams.scount = -1; // too long to be a frame
+    return;
+  }
+  uint8_t f = irparams.sfill;
+  irparams.sdata[f][count / 8] = (irparams.sdata[f][count / 8] << n) | b;
+  irparams.scount = count + n;
+}
+
+// Locks on a stream, at the sync mark ending the frame in rawbuf.  
+// That frame's header space tells the timing mode of the rest.
+static void streamStart() {
+  unsigned int us = irparams.rawbuf[2] * USECPERTICK + MARK_EXCESS;
+  if (us > (SONY_HDR_SPACE + PPM_HDR_SPACE) / 2) {
+    irparams.stream = CTRLM_PPM;
+  }
+  else if (us > (DATA_HDR_SPACE + SONY_HDR_SPACE) / 2) {
+    irparams.stream = CTRLM;
+    irparams.sthresh = ((SONY_ONE_MARK + SONY_ZERO_MARK) / 2 + MARK_EXCESS) 
+      / USECPERTICK;
+  }
+  else {
+    irparams.stream = CTRLM_FAST;
+    irparams.sthresh = ((DATA_ONE_MARK + DATA_ZERO_MARK) / 2 + MARK_EXCESS) 
+      / USECPERTICK;
+  }
+  irparams.sstate = STATE_SPACE;
+  streamFrame();
+}
+
+// The ISR while locked on a stream.  Bits are in the marks, like 
+// decodeCtrlM(), or in the spaces for PPM, like decodeCtrlMPPM().
+static void streamEdge(uint8_t irdata) {
+  if (irparams.sstate == STATE_MARK) {
+    if (irdata == SPACE) { // MARK ended
+      if (MATCH_SYNC(irparams.timer)) {
+        streamEnd();
+        streamFrame();
+      } 
+      else if (irparams.stream != CTRLM_PPM) {
+        streamBits(irparams.timer > irparams.sthresh, 1);
+      }
+      irparams.timer = 0;
+      irparams.sstate = STATE_SPACE;
+    }
+  }
+  else if (irdata == MARK) { // SPACE ended
+    if (irparams.shdr) {
+      irparams.shdr = 0;
+    }
+    else if (irparams.stream == CTRLM_PPM) {
+      int us = irparams.timer * USECPERTICK + MARK_EXCESS 
+        - PPM_SPACE + PPM_SPACE_STEP / 2;
+      if (us < 0 || us >= 4 * PPM_SPACE_STEP) {
+        irparams.scount = -1;
+      } 
+      else {
+        streamBits(us / PPM_SPACE_STEP, 2);
+      }
+    }
+    irparams.timer = 0;
+    irparams.sstate = STATE_MARK;
+  }
+  else if (irparams.timer > GAP_TICKS) {
+    // end of the burst, unlock.  Keep timing the gap, so the 
+    // next header is taken as a new transmission
+    streamEnd();
+    irparams.stream = 0;
+  }
+}
+
 // TIMER2 interrupt code to collect raw data.
 // Widths of alternating SPACE, MARK are recorded in rawbuf.
 // Recorded in ticks of 50 microseconds.
@@ -261,6 +368,7 @@ void IRrecv::blink13(int blinkflag)
 // First entry is the SPACE between transmissions.
 // As soon as a SPACE gets long, ready is set, state switches to IDLE, timing of SPACE continues.
 // As soon as first MARK arrives, gap width is recorded, ready is cleared, and new logging starts
+// A CtrlM sync mark also ends a transmission, and locks on a stream, see above
 ISR(TIMER2_OVF_vect)
 {
   RESET_TIMER2;
@@ -272,7 +380,10 @@ ISR(TIMER2_OVF_vect)
     // Buffer overflow
     irparams.rcvstate = STATE_STOP;
   }
-  switch(irparams.rcvstate) {
+  if (irparams.stream) {
+    streamEdge(irdata);
+  }
+  else switch(irparams.rcvstate) {
   case STATE_IDLE: // In the middle of a gap
     if (irdata == MARK) {
       if (irparams.timer < GAP_TICKS) {
@@ -290,6 +401,16 @@ ISR(TIMER2_OVF_vect)
     break;
   case STATE_MARK: // timing MARK
     if (irdata == SPACE) {   // MARK ended, record time
+      if (irparams.rawlen > 3 && irparams.rawbuf[1] >= SYNC_TICKS_HIGH &&
+          MATCH_SYNC(irparams.timer)) {
+        // CtrlM sync mark after a header: hand the frame so far to 
+        // decode(), and lock on to the stream that follows
+        irparams.rawsync = 1;
+        streamStart();
+        irparams.timer = 0;
+        irparams.rcvstate = STATE_STOP;
+        break;
+      }
       irparams.rawbuf[irparams.rawlen++] = irparams.timer;
       irparams.timer = 0;
       irparams.rcvstate = STATE_SPACE;
@@ -328,9 +449,15 @@ ISR(TIMER2_OVF_vect)
   }
 }
 
+// Frames of a CtrlM stream after the first don't use rawbuf, so 
+// there's nothing to resume after them
 void IRrecv::resume() {
+  if (irparams.rcvstate != STATE_STOP) {
+    return;
+  }
   irparams.rcvstate = STATE_IDLE;
   irparams.rawlen = 0;
+  irparams.rawsync = 0;
 }
 
 
@@ -341,9 +468,19 @@ void IRrecv::resume() {
 int IRrecv::decode(decode_results *results) {
   results->rawbuf = irparams.rawbuf;
   results->rawlen = irparams.rawlen;
+  results->stream = irparams.rawsync;
   if (irparams.rcvstate != STATE_STOP) {
+    if (irparams.sbits[irparams.sread]) {
+      return decodeCtrlMStream(results);
+    }
     return ERR;
   }
+#ifdef DEBUG
+  Serial.println("Attempting CtrlM decode");
+#endif
+  if (decodeCtrlM(results)) {
+    return DECODED;
+  }
   /*
 #ifdef DEBUG
   Serial.println("Attempting Data decode");
@@ -470,6 +607,297 @@ long IRrecv::decodeData(decode_results *results) {
   return DECODED;
 }
 
+// A CtrlM frame is 8 bytes starting with CTRLM_START, or starts with
+// CTRLM_SHORT | n for a short frame of 5+n bytes (n args), or with
+// CTRLM_AGG | n for an aggregate frame of 3+5*n bytes (n commands).  
+// CTRLM_CTX starts a 4-byte context frame, and CTRLM_CMD | n a 
+// command-only frame of 3+n bytes, for the FreeM & BlinkM of the last
+// context frame.
+// CTRLM_IMG | n starts an image frame of 4+3*n bytes (n colors), and
+// CTRLM_PACKED | enc a packed image frame of 5 bytes plus its n colors.
+// Any of them may have CTRLM_FEC set too, and CTRLM_SEQ, which adds a
+// sequence number byte after the first.
+static int ctrlmLengthOk(uint8_t *data, int nbytes) {
+  uint8_t start = data[0] & ~(CTRLM_FEC | CTRLM_SEQ);
+  if (data[0] & CTRLM_SEQ) {
+    nbytes--;
+  }
+  if ((start & 0xf0) == CTRLM_SHORT) {
+    return nbytes == 5 + (start & 0x03);
+  }
+  if ((start & 0xf0) == CTRLM_AGG) {
+    return nbytes == 3 + 5 * (start & 0x07);
+  }
+  if ((start & 0xf0) == CTRLM_CMD) {
+    return nbytes == 3 + (start & 0x03);
+  }
+  if (start == CTRLM_CTX) {
+    return nbytes == 4;
+  }
+  if ((start & 0xf0) == CTRLM_IMG) {
+    return nbytes == 4 + 3 * (start & 0x07);
+  }
+  if ((start & 0xf0) == CTRLM_PACKED && nbytes >= 5) {
+    int n = data[(data[0] & CTRLM_SEQ) ? 4 : 3];
+    if ((start & 0x07) == CTRLM_ENC_565) {
+      return nbytes == 5 + 2 * n;
+    }
+    return (start & 0x07) == CTRLM_ENC_PAL && nbytes == 5 + (n + 1) / 2;
+  }
+  return start == CTRLM_START && nbytes == 8;
+}
+
+// 1 if an odd number of bits are set
+static uint8_t parity8(uint8_t b) {
+  b ^= b >> 4;
+  b ^= b >> 2;
+  b ^= b >> 1;
+  return b & 1;
+}
+
+// CRC-8, polynomial 0x07, same as compute_crc8() in ctrlm.c
+static uint8_t crc8(uint8_t *buf, int len) {
+  uint8_t crc = 0;
+  while (len--) {
+    crc ^= *buf++;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+// FEC frames are {start|CTRLM_FEC, ..., crc8, colpar, rowpar[(len+7)/8]},
+// see ctrlm.c.  A bad row parity bit and a bad column parity bit point
+// at a single flipped bit, which gets flipped back.  Then the CRC has
+// to match.  Returns the frame length without the parity, 0 if bad.
+static int ctrlmFec(decode_results *results, int nbytes) {
+  uint8_t *data = results->data;
+  int len = 1;
+  while (len + 1 + (len + 7) / 8 < nbytes) {
+    len++;
+  }
+  if (len + 1 + (len + 7) / 8 != nbytes) {
+    return 0;
+  }
+  uint8_t col = data[len];
+  int badrow = 0;
+  int nbad = 0;
+  for (int i = 0; i < len; i++) {
+    col ^= data[i];
+    if (parity8(data[i]) != ((data[len + 1 + i / 8] >> (7 - i % 8)) & 1)) {
+      badrow = i;
+      nbad++;
+    }
+  }
+  results->fec = CTRLM_FEC_OK;
+  if (nbad == 1 && col != 0 && (col & (col - 1)) == 0) { 
+    data[badrow] ^= col;
+    results->fec = CTRLM_FEC_FIXED;
+  }
+  if (crc8(data, len - 1) != data[len - 1]) {
+    return 0;
+  }
+  return len;
+}
+
+// Checks the nbits just decoded are a whole CtrlM frame, fixing a
+// bit of an FEC frame if need be.  A frame that doesn't look like FEC 
+// but doesn't check out either gets a go at FEC, in case it was the 
+// CTRLM_FEC bit that flipped.  Returns the frame bits, or 0 if bad.
+static int ctrlmFrame(decode_results *results, int nbits) {
+  uint8_t *data = results->data;
+  int nbytes = nbits / 8;
+  if ((nbits % 8) != 0) {
+    return 0;
+  }
+  results->fec = CTRLM_FEC_NONE;
+  if (!(data[0] & CTRLM_FEC) && ctrlmLengthOk(data, nbytes)) {
+    return nbits;
+  }
+  nbytes = ctrlmFec(results, nbytes);
+  if (nbytes == 0 || !(data[0] & CTRLM_FEC) || 
+      !ctrlmLengthOk(data, nbytes)) {
+    return 0;
+  }
+  return nbytes * 8;
+}
+
+// CtrlM data frames: a header, then whole bytes MSB first, each bit a
+// long (1) or short (0) mark and a fixed space, like Sony.  
+// The header space tells Sony timing from the CtrlM "fast data" timing,
+// or from pulse-position frames, which decodeCtrlMPPM() does.
+// Bytes go in results->data, the checksum is left to the caller.
+long IRrecv::decodeCtrlM(decode_results *results) {
+  int one_mark, zero_mark, space;
+  int offset = 1; // Skip first space
+  if (irparams.rawlen < 2 * 16 + 2) {
+    return ERR;
+  }
+  if (!MATCH_MARK(results->rawbuf[offset], SONY_HDR_MARK)) {
+    return ERR;
+  }
+  offset++;
+  if (MATCH_SPACE(results->rawbuf[offset], DATA_HDR_SPACE)) {
+    one_mark = DATA_ONE_MARK;
+    zero_mark = DATA_ZERO_MARK;
+    space = DATA_ZERO_SPACE;
+    results->decode_type = CTRLM_FAST;
+  }
+  else if (MATCH_SPACE(results->rawbuf[offset], SONY_HDR_SPACE)) {
+    one_mark = SONY_ONE_MARK;
+    zero_mark = SONY_ZERO_MARK;
+    space = SONY_HDR_SPACE;
+    results->decode_type = CTRLM;
+  }
+  else if (MATCH_SPACE(results->rawbuf[offset], PPM_HDR_SPACE)) {
+    return decodeCtrlMPPM(results, offset + 1);
+  }
+  else {
+    return ERR;
+  }
+  offset++;
+
+  int nbits = 0;
+  while (offset < irparams.rawlen) {
+    if (nbits == 8 * CTRLM_MAX_BYTES) {
+      return ERR;
+    }
+    uint8_t b = results->data[nbits / 8] << 1;
+    // nearest of the two mark lengths, so a stretched or squashed mark is
+    // a bit error for the checksum or FEC, not a lost frame
+    if ((long)results->rawbuf[offset] * USECPERTICK - MARK_EXCESS > 
+        (one_mark + zero_mark) / 2) {
+      b |= 1;
+    }
+    results->data[nbits / 8] = b;
+    nbits++;
+    offset++;
+    // last space runs into the gap, so isn't recorded
+    if (offset < irparams.rawlen && 
+        !MATCH_SPACE(results->rawbuf[offset], space)) {
+      return ERR;
+    }
+    offset++;
+  }
+
+  // Success, if it's a whole CtrlM frame
+  nbits = ctrlmFrame(results, nbits);
+  if (nbits == 0) {
+    return ERR;
+  }
+  results->bits = nbits;
+  results->value = 0;
+  checkCtrlMSeq(results);
+  checkCtrlMContext(results);
+  return DECODED;
+}
+
+// Remembers the FreeM & BlinkM addresses of a CtrlM context frame just
+// decoded, which the command-only frames after it go to
+void IRrecv::checkCtrlMContext(decode_results *results) {
+  uint8_t *data = results->data;
+  if ((data[0] & ~(CTRLM_FEC | CTRLM_SEQ)) != CTRLM_CTX) {
+    return;
+  }
+  if (data[0] & CTRLM_SEQ) {
+    data++;
+  }
+  ctxFreem = data[1];
+  ctxBlinkm = data[2];
+}
+
+// Frames of a CtrlM stream after the first, already turned into bits
+// by the ISR (see streamEdge()).  There's no rawbuf for them.
+long IRrecv::decodeCtrlMStream(decode_results *results) {
+  uint8_t f = irparams.sread;
+  int nbits = irparams.sbits[f];
+  for (int i = 0; i < CTRLM_MAX_BYTES; i++) {
+    results->data[i] = irparams.sdata[f][i];
+  }
+  results->decode_type = irparams.stype[f];
+  irparams.sbits[f] = 0; // the ISR can fill it again
+  irparams.sread = f ^ 1;
+  results->rawlen = 0;
+  results->stream = 1;
+  results->value = 0;
+  nbits = ctrlmFrame(results, nbits);
+  if (nbits == 0) {
+    results->decode_type = UNKNOWN;
+    results->bits = 0;
+    return DECODED;
+  }
+  results->bits = nbits;
+  checkCtrlMSeq(results);
+  checkCtrlMContext(results);
+  return DECODED;
+}
+
+// Sets results->seq & dup for a CtrlM frame just decoded.  The CtrlM 
+// sends each frame OPT_REPEATS times with the same sequence number, so
+// one that's in the recent history is a copy, and a FreeM should ignore
+// it.  Only the first copy goes in the history.
+void IRrecv::checkCtrlMSeq(decode_results *results) {
+  results->seq = -1;
+  results->dup = 0;
+  if (!(results->data[0] & CTRLM_SEQ)) {
+    return;
+  }
+  results->seq = results->data[1];
+  for (int i = 0; i < CTRLM_SEQ_HISTORY; i++) {
+    if (seqHistory[i] == results->seq) {
+      results->dup = 1;
+      return;
+    }
+  }
+  seqHistory[seqNext] = results->seq;
+  seqNext = (seqNext + 1) % CTRLM_SEQ_HISTORY;
+}
+
+// CtrlM pulse-position frames: after the header every mark is PPM_MARK,
+// and the space after it is one of four lengths, PPM_SPACE_STEP apart, 
+// carrying 2 bits MSB first.  A stop mark ends the last space.
+// offset is the first data mark.
+long IRrecv::decodeCtrlMPPM(decode_results *results, int offset) {
+  int nbits = 0;
+  while (offset + 1 < irparams.rawlen) {
+    if (nbits == 8 * CTRLM_MAX_BYTES) {
+      return ERR;
+    }
+    if (!MATCH_MARK(results->rawbuf[offset], PPM_MARK)) {
+      return ERR;
+    }
+    offset++;
+    // round to the nearest of the four space lengths
+    long us = (long)results->rawbuf[offset] * USECPERTICK + MARK_EXCESS 
+      - PPM_SPACE + PPM_SPACE_STEP / 2;
+    if (us < 0 || us >= 4 * PPM_SPACE_STEP) {
+      return ERR;
+    }
+    uint8_t sym = us / PPM_SPACE_STEP;
+    results->data[nbits / 8] = (results->data[nbits / 8] << 2) | sym;
+    nbits += 2;
+    offset++;
+  }
+  // stop mark, unless a sync mark ended the frame instead
+  if (!results->stream && (offset >= irparams.rawlen || 
+      !MATCH_MARK(results->rawbuf[offset], PPM_MARK))) {
+    return ERR;
+  }
+
+  // Success, if it's a whole CtrlM frame
+  nbits = ctrlmFrame(results, nbits);
+  if (nbits == 0) {
+    return ERR;
+  }
+  results->bits = nbits;
+  results->value = 0;
+  checkCtrlMSeq(results);
+  checkCtrlMContext(results);
+  results->decode_type = CTRLM_PPM;
+  return DECODED;
+}
+
 long IRrecv::decodeSony(decode_results *results) {
   long data = 0;
   if (irparams.rawlen < 2 * SONY_BITS + 2) {
@@ -22,12 +22,20 @@
 
 #include <inttypes.h>
 
+#define CTRLM_MAX_BYTES 28 // longest CtrlM data frame, FEC aggregate of 4 cmds
+#define CTRLM_SEQ_HISTORY 8 // sequence numbers remembered, to drop copies
+
 // Results returned from the decoder
 class decode_results {
 public:
   uint8_t decode_type; // NEC, SONY, RC5, UNKNOWN
   unsigned long value; // Decoded value
   int bits; // Number of bits in decoded value
+  uint8_t data[CTRLM_MAX_BYTES]; // Decoded bytes, for CTRLM frames
+  uint8_t fec; // CTRLM_FEC_*, for CTRLM frames
+  int seq; // Sequence number of CTRLM frames, -1 if none
+  uint8_t dup; // 1 if seq was seen recently, the frame is a copy
+  uint8_t stream; // 1 if the frame was part of a CtrlM stream
   volatile unsigned int *rawbuf; // Raw intervals in .5 us ticks
   int rawlen; // Number of records in rawbuf.
 };
@@ -38,8 +46,16 @@ public:
 #define RC5 3
 #define RC6 4
 #define DATA 5
+#define CTRLM 6      // CtrlM frame, Sony timing
+#define CTRLM_FAST 7 // CtrlM frame, fast DATA_* timing
+#define CTRLM_PPM 8  // CtrlM frame, 2 bits per space PPM_* timing
 #define UNKNOWN -1
 
+// Values for fec
+#define CTRLM_FEC_NONE 0  // plain frame, check the checksum
+#define CTRLM_FEC_OK 1    // FEC frame, CRC good
+#define CTRLM_FEC_FIXED 2 // FEC frame, CRC good after fixing a bit
+
 // Decoded value for NEC when a repeat code is received
 #define REPEAT 0xffffffff
 
@@ -56,6 +72,15 @@ public:
   // These are called by decode
   uint8_t getRClevel(decode_results *results, int *offset, int *used, int t1);
   long decodeData(decode_results *results);
+  long decodeCtrlM(decode_results *results);
+  long decodeCtrlMPPM(decode_results *results, int offset);
+  long decodeCtrlMStream(decode_results *results);
+  void checkCtrlMSeq(decode_results *results);
+  int seqHistory[CTRLM_SEQ_HISTORY]; // last CtrlM sequence numbers seen
+  uint8_t seqNext; // where in seqHistory the next one goes
+  void checkCtrlMContext(decode_results *results);
+  int ctxFreem; // FreeM addr of the last CtrlM context frame, -1 if none
+  int ctxBlinkm; // BlinkM addr of the last CtrlM context frame
   long decodeNEC(decode_results *results);
   long decodeSony(decode_results *results);
   long decodeRC5(decode_results *results);
@@ -25,7 +25,7 @@
 
 #define BLINKLED 13
 
-#define RAWBUF 76 // Length of raw duration buffer
+#define RAWBUF 460 // Length of raw duration buffer, fits a 28-byte CtrlM frame
 
 // defines for setting and clearing register bits
 #ifndef cbi
@@ -68,6 +68,25 @@
 #define DATA_ONE_MARK   600
 #define DATA_ONE_SPACE  300
 
+#define PPM_HDR_MARK    2400
+#define PPM_HDR_SPACE   1200
+#define PPM_MARK        300
+#define PPM_SPACE       300
+#define PPM_SPACE_STEP  300
+
+#define CTRLM_START 0x55 // first byte of a standard CtrlM frame
+#define CTRLM_SHORT 0x60 // first byte of a short frame, | num args
+#define CTRLM_AGG   0x70 // first byte of an aggregate frame, | num cmds
+#define CTRLM_FEC   0x80 // set in first byte of a frame with CRC-8 & parity
+#define CTRLM_SEQ   0x08 // set in first byte if a sequence number follows
+#define CTRLM_CMD   0x30 // first byte of a command-only frame, | num args
+#define CTRLM_CTX   0x40 // first byte of a context frame
+#define CTRLM_IMG   0x20 // first byte of an image frame, | num colors
+#define CTRLM_PACKED 0x10 // first byte of a packed image frame, | encoding
+#define CTRLM_ENC_565 1  // packed image colors are RGB565
+#define CTRLM_ENC_PAL 2  // packed image colors are 4-bit palette indexes
+#define CTRLM_SYNC_MARK 1800 // mark between the frames of a stream
+
 //#define TOLERANCE 25  // percent tolerance in measurements
 #define TOLERANCE 35  // percent tolerance in measurements
 #define LTOL (1.0 - TOLERANCE/100.) 
@@ -90,6 +109,14 @@
 // Debugging versions are in IRremote.cpp
 #endif
 
+// A CtrlM sync mark is nearer CTRLM_SYNC_MARK than a data or header mark
+#define SYNC_TICKS_LOW ((SONY_ONE_MARK + CTRLM_SYNC_MARK) / 2 / USECPERTICK + \
+                        MARK_EXCESS / USECPERTICK)
+#define SYNC_TICKS_HIGH ((CTRLM_SYNC_MARK + SONY_HDR_MARK) / 2 / USECPERTICK + \
+                         MARK_EXCESS / USECPERTICK)
+#define MATCH_SYNC(measured_ticks) ((measured_ticks) > SYNC_TICKS_LOW && \
+                                    (measured_ticks) < SYNC_TICKS_HIGH)
+
 // receiver states
 #define STATE_IDLE     2
 #define STATE_MARK     3
@@ -103,7 +130,20 @@ typedef struct {
   uint8_t blinkflag;         // TRUE to enable blinking of pin 13 on IR processing
   unsigned int timer;     // state timer, counts 50uS ticks.
   unsigned int rawbuf[RAWBUF]; // raw data
-  uint8_t rawlen;         // counter of entries in rawbuf
+  unsigned int rawlen;    // counter of entries in rawbuf
+  uint8_t rawsync;        // 1 if rawbuf's frame ended at a sync mark
+  // Locked on a CtrlM stream, the ISR decodes the frames itself, 
+  // into sdata, since each starts right after the last one's sync mark
+  uint8_t stream;         // decode_type of the stream, 0 if not locked on
+  uint8_t sstate;         // STATE_MARK or STATE_SPACE, while locked on
+  uint8_t shdr;           // 1 if the next space is a header space
+  uint8_t sthresh;        // marks longer than this many ticks are 1 bits
+  int scount;             // bits so far in sdata[sfill], -1 if dropped
+  uint8_t sfill;          // sdata frame the ISR is filling
+  uint8_t sread;          // sdata frame decode() takes next
+  uint8_t sbits[2];       // bits in each sdata frame, 0 == free
+  uint8_t stype[2];       // decode_type of each sdata frame
+  uint8_t sdata[2][CTRLM_MAX_BYTES]; // streamed frames
 } 
 irparams_t;
 